@@ -37,6 +37,8 @@ case WM_ERASEBKGND:
 
 #include "bmph.h"
 
+#include "loader.h"
+
 Bitmap *screen = NULL;
 
 static FILE *outfile;
@@ -176,6 +178,8 @@ int main(int argc, char *argv[]) {
 	int64_t deltat = 0ll;
 	while(fenster_loop(&f) == 0 && !quit) {
 		int64_t start = fenster_time();
+		/* Hand over any assets that finished loading in the background */
+		ld_update();
 		update_screen(deltat);
 		copy_screen(&f);
 
@@ -197,6 +201,7 @@ int main(int argc, char *argv[]) {
 		//if(ctr++ == 30) break;
 	}
 
+	ld_deinit();
 	deinit_thing();
 
 	fenster_close(&f);
@@ -1,9 +1,51 @@
 typedef struct BmCache BmCache;
 
+/* Loads the bitmap `name` for `bc_get()` when it isn't in the cache */
+typedef Bitmap *(*bc_loader_fn)(const char *name, void *udata);
+
+typedef struct {
+    unsigned long hits, misses;
+    unsigned long loads;        /* Misses that the loader filled */
+    unsigned long evictions;
+    int count;                  /* Bitmaps in the cache */
+    size_t bytes;               /* Memory used by their pixels */
+} BcStats;
+
 BmCache *bc_create();
 
 void bc_destroy(BmCache *ht);
 
 Bitmap *bc_put(BmCache *ht, const char *name, Bitmap *j);
 
-Bitmap *bc_get(BmCache *ht, const char *name);
\ No newline at end of file
+/* Returns the bitmap `name`, loading it if there is a loader and it isn't
+ * cached. The pointer stays valid until the next call that can evict it. */
+Bitmap *bc_get(BmCache *ht, const char *name);
+
+/* Limits the memory used by the cached bitmaps to `bytes`; 0 means no limit.
+ * When the cache is over budget the least recently used bitmaps that are
+ * not locked are released. Without a loader an evicted bitmap is gone, and
+ * `bc_get()` returns NULL for it.
+ * Releasing a bitmap frees it unless something else retained it. fx
+ * retains the textures of the triangles queued for `fx_flush_translucent()`
+ * until they are drawn, but any other pointer that must outlive a call
+ * that can evict, such as a texture bound with `fx_set_texture()` while
+ * other bitmaps are fetched before drawing with it, needs `bc_lock()`.
+ * The mipmaps fx builds for filtered textures are not counted here; They
+ * have their own limit, `fx_texture_cache_budget()`. */
+void bc_set_budget(BmCache *ht, size_t bytes);
+
+void bc_set_loader(BmCache *ht, bc_loader_fn load, void *udata);
+
+/* Locks the bitmap `name` in the cache, so it isn't evicted while it is
+ * being used elsewhere. Locks nest; Returns the bitmap, or NULL. */
+Bitmap *bc_lock(BmCache *ht, const char *name);
+void bc_unlock(BmCache *ht, const char *name);
+
+/* Returns a handle for `name` that stays valid for the life of the cache,
+ * so that draw code can look up its bitmap without hashing the name */
+int bc_intern(BmCache *ht, const char *name);
+
+/* Like `bc_get()`, for a handle from `bc_intern()` */
+Bitmap *bc_get_handle(BmCache *ht, int handle);
+
+void bc_get_stats(BmCache *ht, BcStats *stats);
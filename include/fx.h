@@ -29,6 +29,34 @@ typedef enum {FX_TRIANGLES, FX_TRIANGLE_STRIP, FX_TRIANGLE_FAN} fx_mode;
 
 typedef enum {FX_FOG_NONE = 0, FX_FOG_LINEAR, FX_FOG_EXP, FX_FOG_EXP2} fg_fog_type;
 
+typedef enum {
+    FX_FILTER_NEAREST = 0,  /* Point sampling (the default) */
+    FX_FILTER_BILINEAR,     /* Bilinear sampling of the full size texture */
+    FX_FILTER_MIPMAP,       /* Point sampling from the nearest mipmap */
+    FX_FILTER_TRILINEAR     /* Bilinear sampling from the two nearest mipmaps */
+} fx_filter;
+
+typedef enum {
+    FX_BLEND_NONE = 0,      /* Pixels are replaced (the default) */
+    FX_BLEND_AVERAGE,       /* Half the pixel and half the destination */
+    FX_BLEND_ALPHA,         /* src * alpha + dst * (1 - alpha) */
+    FX_BLEND_ADD,           /* src * alpha + dst */
+    FX_BLEND_MULTIPLY,      /* src * dst, faded to dst by alpha */
+    FX_BLEND_PREMULTIPLIED  /* src + dst * (1 - alpha), for textures whose colors are multiplied by their alpha */
+} fx_blend_mode;
+
+typedef enum {
+    FX_DEPTH_LESS = 0,      /* Pixels nearer than the depth buffer are drawn (the default) */
+    FX_DEPTH_LEQUAL,        /* Pixels at least as near as the depth buffer are drawn */
+    FX_DEPTH_EQUAL          /* Only pixels exactly at the depth buffer's depth are drawn */
+} fx_depth_test;
+
+typedef enum {
+    FX_WRAP_REPEAT = 0,     /* The texture repeats (the default) */
+    FX_WRAP_CLAMP,          /* The edge texels are repeated */
+    FX_WRAP_MIRROR          /* The texture repeats, mirrored every other time */
+} fx_wrap;
+
 void fx_set_viewport(Bitmap *target);
 
 void fx_make_projection(numeric_t fovy, numeric_t near, numeric_t far);
@@ -47,6 +75,15 @@ int fx_texcoord(double u, double v);
 int fx_normal(double x, double y, double z);
 int fx_color(double r, double g, double b);
 
+/* Draws `ntris` triangles from the vertices in the arrays, with each
+ * triangle given by three consecutive `indices`. Every vertex is only
+ * transformed and lit once, however many triangles share it.
+ * `verts`, `norms` and `colors` have 3 components per vertex and `texs`
+ * has 2; `texs`, `norms` and `colors` may be NULL.
+ * Must not be called between `fx_begin()` and `fx_end()`. */
+int fx_draw_indexed(const numeric_t *verts, const numeric_t *texs, const numeric_t *norms, const numeric_t *colors,
+        int nverts, const int *indices, int ntris);
+
 #define fx_vertex_v3(v3) fx_vertex(v3[0], v3[1], v3[2])
 #define fx_normal_v3(v3) fx_normal(v3[0], v3[1], v3[2])
 #define fx_color_v3(v3) fx_color(v3[0], v3[1], v3[2])
@@ -60,6 +97,29 @@ void fx_save_view(mat4_t dest);
 void fx_save_projection(mat4_t dest);
 
 void fx_set_texture(Bitmap *texture);
+
+/* Packed textures take a fraction of the memory of a Bitmap, and are
+ * sampled directly by the rasterizer. They are always point sampled (but
+ * `fx_texture_dither()` works with them), and are addressed like the
+ * bitmap's clipping rectangle they came from. */
+typedef struct FX_PACKED FX_PACKED;
+
+/* Creates a palettized texture of a byte per texel from `w*h` `indices`
+ * into the 256 colors of `palette`. Texels of palette index `key` are
+ * transparent; Use -1 for none. */
+FX_PACKED *fx_pack_palette(int w, int h, const unsigned char *indices, const unsigned int *palette, int key);
+
+/* Creates a block compressed texture from `b`, at half a byte per texel.
+ * The bitmap's color is the transparent color, and is kept exactly. */
+FX_PACKED *fx_pack_blocks(Bitmap *b);
+
+void fx_packed_free(FX_PACKED *p);
+
+/* Returns the number of bytes `p` uses */
+size_t fx_packed_size(const FX_PACKED *p);
+
+/* Like `fx_set_texture()`, for packed textures */
+void fx_set_packed_texture(FX_PACKED *texture);
 void fx_transparent(int enabled);
 
 void fx_all_lighting(int enabled);
@@ -68,23 +128,182 @@ void fx_light_enable(unsigned int index);
 
 void fx_light_disable(unsigned int index);
 
+/* Lights every pixel with a normal interpolated from the vertices' normals
+ * instead of interpolating the colors lit at the vertices, which avoids the
+ * faceted look of low poly models but costs a square root and a loop over
+ * the lights per pixel. Vertex colors are ignored on lit triangles in this
+ * mode. */
+void fx_per_pixel_lighting(int enabled);
+
+/* Adds a light at `pos` in world space that fades out with distance and
+ * doesn't reach past `radius`. Unlike the directional lights there is no
+ * limit on their number: Each batch and then each triangle is only lit by
+ * the lights that can reach it. Returns the light's index. */
+int fx_add_point_light(vec3_t pos, double r, double g, double b, double radius);
+
+/* Like `fx_add_point_light()`, but the light shines in a cone along `dir`,
+ * at full strength within `inner` degrees of its axis and fading out to
+ * nothing at `outer` degrees. */
+int fx_add_spot_light(vec3_t pos, vec3_t dir, double r, double g, double b, double radius, double inner, double outer);
+
+/* Removes all the point and spot lights, typically to add the ones for
+ * the next frame */
+void fx_clear_local_lights();
+int fx_local_light_count();
+
+/* Lights the `n` normals in `normals`, in model space, with the current
+ * lights, material and model matrix, and stores their colors in `colors`.
+ * Models with quantized normals can light their table of normals once per
+ * draw, and pass the colors to `fx_color()` instead of their normals to
+ * `fx_normal()`. Point and spot lights are evaluated at the model's origin.
+ * Returns 0 without lighting anything if lighting is disabled, per pixel or
+ * deferred, in which case the normals should be used. */
+int fx_light_normals(const double *normals, int n, double *colors);
+
 void fx_set_ambient(double r, double g, double b);
 
 void fx_set_diffuse_color(unsigned int index, double r, double g, double b);
 void fx_set_diffuse_direction(unsigned int index, double x, double y, double z);
 
+/* Sets the material, which has no specular highlights */
 void fx_set_material(vec3_t ambient, vec3_t diffuse, vec3_t emissive);
+
+/* Gives the material set by `fx_set_material()` Blinn-Phong highlights
+ * of the color `specular`, that are sharper the higher `shininess` is,
+ * like the `Ks` and `Ns` of an OBJ material. They are added to the diffuse
+ * lighting, per vertex or per pixel, and lit by the lights' colors. */
+void fx_set_specular(vec3_t specular, double shininess);
 void fx_reset_material();
 
 void fx_backface(int enabled);
 
+/* `fx_blend(1)` is `fx_set_blend(FX_BLEND_AVERAGE)` */
 void fx_blend(int enabled);
 
+/* Sets how pixels are combined with the ones already drawn. The alpha is
+ * the texture's alpha channel times the material's alpha. */
+void fx_set_blend(fx_blend_mode mode);
+
+/* Sets the material's alpha, in [0,1]. Without a blend mode, triangles
+ * with an alpha below 1 are blended with FX_BLEND_ALPHA.
+ * `fx_set_material()` and `fx_reset_material()` reset it to 1. */
+void fx_set_alpha(double alpha);
+
+/* Whether drawing updates the depth buffer (the default) */
+void fx_depth_write(int enabled);
+
+/* With color writes disabled, triangles only update the depth buffer: They
+ * aren't lit, textured (except to find the holes of transparent textures)
+ * or picked, and blended triangles are skipped. A depth prepass drawn like
+ * this followed by a pass over the same geometry with FX_DEPTH_EQUAL (or
+ * FX_DEPTH_LEQUAL) shades every pixel once. The passes have to draw the
+ * triangles the same way, with the same transforms, for their depths to
+ * match exactly. Pixels on an edge shared by two triangles can still be
+ * drawn by both. */
+void fx_color_write(int enabled);
+
+/* Sets which pixels pass the depth test */
+void fx_set_depth_test(fx_depth_test test);
+
+/* With sorting enabled, blended triangles are queued instead of drawn, and
+ * `fx_flush_translucent()` draws them back to front afterwards, so that
+ * translucent objects don't need to be sorted by the caller. Triangles at
+ * the same depth are drawn in the order they were queued. The state they
+ * are drawn with is captured when they are queued, except that per pixel
+ * lighting is done at their vertices, and their textures must still exist
+ * when they are flushed. */
+void fx_sort_translucent(int enabled);
+
+/* Draws the queued translucent triangles farthest first, without writing
+ * the depth buffer, and empties the queue. Call it after the opaque
+ * geometry. Returns the number of triangles drawn. */
+int fx_flush_translucent();
+
+/* Order independent transparency: Blended pixels are kept in per pixel
+ * lists of up to `per_pixel` fragments instead of being drawn, and
+ * `fx_oit_resolve()` sorts and blends them at the end of the frame.
+ * The fragments come from an arena of `max_bytes` bytes (0 for a default
+ * of 16 fragments per pixel), allocated once. When a pixel's list is full
+ * its farthest fragment is blended straight away, and when the arena is
+ * full new fragments are, so the result degrades gracefully instead of
+ * failing. `per_pixel` of 0 disables it. */
+void fx_oit(int per_pixel, size_t max_bytes);
+
+/* Blends the fragments stored since the last call farthest first, skipping
+ * those hidden by opaque pixels drawn after them, and empties the lists.
+ * Returns the number of fragments that didn't fit and were blended out of
+ * order in the meantime. */
+int fx_oit_resolve();
+
+/* Deferred shading: Lit triangles are lit per pixel, but their opaque pixels
+ * only store their normal, texel and material in a G-buffer when they are
+ * drawn, and `fx_deferred_resolve()` lights and fogs the pixels that are
+ * still visible at the end of the frame, so pixels that get drawn over are
+ * never lit. Up to 255 materials can be used between resolves; Triangles
+ * with more, and blended triangles, are lit as they are drawn. Blended
+ * triangles should be drawn after the resolve. */
+void fx_deferred(int enabled);
+
+/* Lights the pixels in the G-buffer in rows `y0` to `y1 - 1` with the
+ * current lights, fog, view and projection. Calls for rows that don't
+ * overlap can run on separate threads while nothing else is drawn; Call
+ * `fx_deferred_clear()` once they have all finished.
+ * Returns the number of pixels lit. */
+int fx_deferred_shade(int y0, int y1);
+
+/* Lights the pixels left in the G-buffer, and forgets its materials */
+int fx_deferred_resolve();
+
+/* Ends the frame without lighting anything: Forgets the G-buffer's
+ * materials, so that the next frame can use 255 again, and drops any pixels
+ * that weren't lit. */
+void fx_deferred_clear();
+
 void fx_texture_dither(int enabled);
 
+/* Makes the rasterizer do the perspective divide only every `pixels`
+ * pixels along each row, and interpolate the texture coordinates, colors
+ * and depth linearly in between. 0 (the default) divides at every pixel.
+ * Spans of 8 or 16 pixels are typical.
+ * Within a span the texture coordinates are off by at most
+ * `pixels^2/4 * |d(1/w)/dx| / (1/w) * |du/dx|` texels, which is well under
+ * a texel unless the surface is viewed at a grazing angle. */
+void fx_perspective_span(int pixels);
+
+/* Sets how textures are sampled. Bilinear filtering blends the four
+ * nearest texels; Unlike `fx_texture_dither()` it is smooth at any
+ * magnification, but it is a bit slower.
+ * The mipmapped filters pick the mipmap for every pixel from how fast the
+ * texture coordinates change across the screen, so minified textures don't
+ * alias and are sampled from smaller images.
+ * A texture's mipmaps are built from its clipping rectangle the first time
+ * it is drawn with a mipmapped filter, and kept until `fx_texture_changed()`
+ * or `fx_cleanup()` is called, or until the cache needs the room.
+ * FX_FILTER_BILINEAR samples the texture itself, and builds no mipmaps. */
+void fx_texture_filter(fx_filter filter);
+
+/* Limits the memory the mipmaps use to `bytes`, 64MB by default; 0 means
+ * no limit. When the limit is exceeded the mipmaps of the textures drawn
+ * least recently are discarded, and built again if they are drawn again.
+ * This is separate from any BmCache budget. */
+void fx_texture_cache_budget(size_t bytes);
+
+/* Sets what happens to texture coordinates outside [0,1] */
+void fx_texture_wrap(fx_wrap mode);
+
+/* Discards the mipmaps of `texture`. Call this after drawing on a texture,
+ * or before freeing it, if it has been drawn with a mipmapped filter. */
+void fx_texture_changed(Bitmap *texture);
+
 void fx_fog(fg_fog_type type);
 void fx_fog_params(double r, double g, double b, double near, double far, double density);
 
+/* Computes the fog at the vertices and interpolates it, instead of looking
+ * it up for every pixel in a table of the fog by depth. It is a little
+ * faster, but the exponential fogs are only approximated on large
+ * triangles. */
+void fx_fog_per_vertex(int enabled);
+
 void fx_set_pick(Bitmap *pick);
 
 void fx_set_target_color(unsigned int color);
@@ -0,0 +1,85 @@
+/**
+ * loader.h
+ * ========
+ * Loads models and textures on a pool of background threads, so that
+ * loading them doesn't stall the render loop.
+ *
+ * A job is submitted with a filename and a function to load it, and a
+ * handle to the job is returned immediately. The result can be polled for
+ * with `ld_status()`, waited for with `ld_wait()`, or delivered to a
+ * callback: Completed jobs' callbacks are run by `ld_update()`, which
+ * should be called once per frame from the main thread.
+ *
+ * The load functions run on the worker threads, so they must not touch
+ * anything the main thread uses without locking. The loaders in this
+ * library only share these globals with the main thread:
+ *  - `fx_error` and `fx_readfile`, which must be safe to call from any
+ *    thread, and must not be changed while jobs are pending.
+ *  - bmph's last error, which `bm_load()` sets on the worker threads, so
+ *    `bm_get_error()` can't be relied on while bitmap jobs are pending.
+ * `ld_mdl()` copies the settings of `mdl_set_palette()` and
+ * `mdl_packed_skins()` when the job is submitted, so those may change at
+ * any time; `mdl_load()` itself reads them while it runs. Things like
+ * `md5_set_shader()` should be done in the callback instead.
+ */
+#ifndef LOADER_H
+#define LOADER_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct LD_JOB LD_JOB;
+
+typedef enum {LD_PENDING, LD_DONE, LD_FAILED} ld_status_t;
+
+/* Loads `filename`; Returns NULL on failure */
+typedef void *(*ld_load_fn)(const char *filename);
+
+/* Called from `ld_update()` when a job completes.
+ * `data` is the loaded object, which the callback takes ownership of,
+ * or NULL if the load failed. */
+typedef void (*ld_done_fn)(LD_JOB *job, void *data, void *udata);
+
+/* Starts `nthreads` worker threads; If `nthreads < 0` one thread per CPU
+ * is used. If `nthreads` is 0, or the platform has no threads, jobs are
+ * loaded immediately by `ld_submit()` but their callbacks are still only
+ * run by `ld_update()`. Returns the number of threads started. */
+int ld_init(int nthreads);
+
+/* Finishes all the jobs that have been submitted, runs their callbacks
+ * and stops the worker threads. */
+void ld_deinit(void);
+
+/* Submits a job to load `filename` with `load`. `done` may be NULL.
+ * The returned handle has to be released with `ld_release()`. */
+LD_JOB *ld_submit(ld_load_fn load, const char *filename, ld_done_fn done, void *udata);
+
+/* Shorthands for the loaders in this library */
+LD_JOB *ld_bitmap(const char *filename, ld_done_fn done, void *udata);
+LD_JOB *ld_obj(const char *filename, ld_done_fn done, void *udata);
+LD_JOB *ld_md2(const char *filename, ld_done_fn done, void *udata);
+LD_JOB *ld_mdl(const char *filename, ld_done_fn done, void *udata);
+LD_JOB *ld_md5_mesh(const char *filename, ld_done_fn done, void *udata);
+LD_JOB *ld_md5_anim(const char *filename, ld_done_fn done, void *udata);
+
+ld_status_t ld_status(LD_JOB *job);
+
+/* Blocks until the job is loaded, and returns the loaded object (or NULL).
+ * If the job has a callback, the object still belongs to the callback,
+ * which gets it from the next `ld_update()`. */
+void *ld_wait(LD_JOB *job);
+
+/* Releases the handle. The job itself still completes and its callback
+ * still gets run if it hasn't been yet. */
+void ld_release(LD_JOB *job);
+
+/* Runs the callbacks of the jobs that have completed since the last call.
+ * Returns the number of jobs whose callbacks have not been run yet. */
+int ld_update(void);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif
+
+#endif
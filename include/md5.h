@@ -25,6 +25,7 @@ typedef struct {
 
 typedef struct {
     char *shader;
+    int texture;    /* Handle of `shader` in the texture cache, or -1 */
     int numverts;
     MD5_VERT *verts;
     int numtris;
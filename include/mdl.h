@@ -62,6 +62,7 @@ typedef struct mdl_skin {
     int num_textures;
     float *times;
     Bitmap **textures;
+    struct FX_PACKED **packed;  /* Used instead of `textures` after `mdl_packed_skins(1)` */
 } mdl_skin;
 
 typedef struct MDL_MESH {
@@ -84,8 +85,26 @@ extern uint8_t mdl_hexen2_palette[];
 
 void mdl_set_palette(uint8_t *pal);
 
+/* If `enabled`, `mdl_load()` keeps the skins palettized, as they are in the
+ * file, in `mdl_skin.packed`, and leaves the entries of `textures` NULL.
+ * This uses a quarter of the memory. */
+void mdl_packed_skins(int enabled);
+
+/* The settings of `mdl_set_palette()` and `mdl_packed_skins()`, copied by
+ * `mdl_get_settings()` so that a load on another thread doesn't see them
+ * change while it runs. */
+typedef struct {
+    uint8_t palette[768];
+    int packed_skins;
+} MDL_SETTINGS;
+
+void mdl_get_settings(MDL_SETTINGS *s);
+
 MDL_MESH *mdl_load(const char *filename);
 
+/* Like `mdl_load()`, but with the settings in `s` instead of the current ones */
+MDL_MESH *mdl_load_with(const char *filename, const MDL_SETTINGS *s);
+
 void mdl_free(MDL_MESH *m);
 
 void mdl_draw(MDL_MESH *m, double frame);
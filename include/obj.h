@@ -11,12 +11,17 @@
 
 typedef struct OBJ_DArray OBJ_DArray;
 
+typedef struct OBJ_Hash OBJ_Hash;
+
 typedef struct OBJ_FACE_VERTEX {
 	int v, vt, vn;
 } OBJ_FACE_VERTEX;
 
 typedef struct OBJ_FACE {
 
+	/* The face's vertices. These normally point into the mesh's
+	packed `fv` array, in which case `a` is 0; Otherwise `a` is
+	the number of vertices allocated for this face alone. */
 	OBJ_FACE_VERTEX *fv;
 	int n;
 	int a;
@@ -42,6 +47,8 @@ typedef struct {
 	int illum;
 
 	char *map_Kd;
+	int texture;	/* Handle of `map_Kd` in the texture cache, or -1 */
+	unsigned int texture_serial;	/* The texture cache `texture` came from */
 } OBJ_MTL;
 
 typedef struct OBJ_MESH {
@@ -52,6 +59,14 @@ typedef struct OBJ_MESH {
 
 	OBJ_DArray *faces;  /* Faces */
 
+	OBJ_FACE_VERTEX *fv; /* Packed vertices of all the faces */
+
+	/* While every face is packed, the offset of each face's vertices in
+	`fv`, with one more at the end. Set by the loaders and `obj_pack()`,
+	and NULL after `obj_face()` or `obj_new_face()`, which may change
+	the faces. */
+	int *fo;
+
     OBJ_DArray *groups;
 
 	char * name;
@@ -62,20 +77,105 @@ typedef struct OBJ_MESH {
 
 	OBJ_DArray *materials;
 
+	/* Lookup tables for `obj_vert_at()`, `obj_norm_at()` and
+	`obj_tex_at()`. They're created the first time they're needed. */
+	OBJ_Hash *vhash, *nhash, *thash;
+	double weld_epsilon;
+
+	/* The file mapped by `obj_load_binary()`, if any. The vertices,
+	normals, texture coordinates and `fv` point into it. */
+	char *bin;
+	size_t bin_len;
+
 } OBJ_MESH;
 
+/* A range of triangles in an OBJ_RENDER_MESH that share a material,
+ * and whether they have texture coordinates and normals.
+ * Each batch has its own range of vertices, and its indices are
+ * relative to the first of them. */
+typedef struct {
+	numeric_t Ka[3];
+	numeric_t Kd[3];
+	numeric_t Ke[3];
+	numeric_t Ks[3];
+	float Ns;
+	float d;
+
+	int has_texs, has_norms;
+
+	char *map_Kd;
+	int texture;
+	unsigned int texture_serial;
+
+	int vfirst, nverts;
+	int tfirst, ntris;
+} OBJ_BATCH;
+
+/* An OBJ_MESH compiled for drawing by `obj_compile()`: Faces are
+ * triangulated, each unique v/vt/vn combination becomes a single vertex,
+ * and the triangles are sorted into one batch per material. */
+typedef struct {
+	int nverts;
+	numeric_t *verts; /* 3 components per vertex */
+	numeric_t *texs;  /* 2 components per vertex */
+	numeric_t *norms; /* 3 components per vertex */
+
+	int ntris;
+	int *indices;     /* 3 per triangle */
+
+	int nbatches;
+	OBJ_BATCH *batches;
+} OBJ_RENDER_MESH;
+
 OBJ_MESH *obj_create();
 
 void obj_free(OBJ_MESH *m);
 
+/* Loads an OBJ file. The faces keep their order from the file. */
 OBJ_MESH *obj_load(const char *filename);
 
+/* Like `obj_load()`, but splits large files into chunks that are parsed
+ * on `nthreads` threads. If `nthreads <= 0` one thread per CPU is used.
+ * The resulting mesh is identical to the one `obj_load()` produces. */
+OBJ_MESH *obj_load_parallel(const char *filename, int nthreads);
+
 int obj_save(OBJ_MESH *m, const char *objfile, const char *mtlfile);
 
+/* Saves the mesh and its materials in a binary format that
+ * `obj_load_binary()` can map straight into memory, as a cache for
+ * meshes that are expensive to parse from OBJ files.
+ * The format depends on the byte order and on `numeric_t`, so the
+ * files are not portable between builds. */
+int obj_save_binary(OBJ_MESH *m, const char *filename);
+
+/* Loads a mesh saved by `obj_save_binary()`.
+ * The vertices, normals, texture coordinates and face vertices are used
+ * in place from a private mapping of the file and are shared with other
+ * processes that map the same file until they are modified. Every face
+ * vertex index is checked once here, which reads the face vertices in.
+ * Returns NULL if the file is not a valid mesh for this build. */
+OBJ_MESH *obj_load_binary(const char *filename);
+
 #ifndef OBJ_NODRAW
+/* Makes `obj_draw()` and `obj_draw_compiled()` bind each material's
+ * `map_Kd` texture from `cache`. Each name is interned the first time its
+ * material is drawn, and again after the cache is set, so meshes that were
+ * drawn with another cache find their textures in the new one.
+ * NULL (the default) leaves the texture alone. */
+struct BmCache;
+void obj_set_texture_cache(struct BmCache *cache);
+
 void obj_draw(OBJ_MESH *obj);
 #endif
 
+OBJ_RENDER_MESH *obj_compile(OBJ_MESH *m);
+
+void obj_compiled_free(OBJ_RENDER_MESH *r);
+
+#ifndef OBJ_NODRAW
+void obj_draw_compiled(OBJ_RENDER_MESH *r);
+#endif
+
 int obj_nfaces(OBJ_MESH *m);
 
 /* gets the `n`th face of mesh `m` */
@@ -85,6 +185,13 @@ int obj_new_face(OBJ_MESH *m);
 
 int obj_face_add_vertex(OBJ_FACE *face, int v, int vt, int vn);
 
+/* Moves the vertices of all faces into the mesh's packed `fv` array and
+ * sorts the faces by material, so that they can be drawn with as few
+ * material changes as possible. Meshes from `obj_load()` are already
+ * packed, but not sorted. `obj_compile()` groups the faces by material
+ * without this. */
+void obj_pack(OBJ_MESH *m);
+
 int obj_nverts(OBJ_MESH *m);
 
 vec3_t obj_vert(OBJ_MESH *m, int n);
@@ -110,6 +217,14 @@ int obj_new_tex(OBJ_MESH *m, numeric_t u, numeric_t v);
 
 int obj_tex_at(OBJ_MESH *m, numeric_t u, numeric_t v);
 
+/* Sets how far apart (in each component) two vertices, normals or texture
+ * coordinates can be for `obj_vert_at()`, `obj_norm_at()` and `obj_tex_at()`
+ * to consider them the same. The default is 0, which means they have to
+ * match exactly.
+ * The lookup tables are rebuilt, so call this again if you modify the
+ * elements of the mesh through `obj_vert()` and friends. */
+void obj_weld_epsilon(OBJ_MESH *m, double epsilon);
+
 void obj_normalize_size(OBJ_MESH *obj);
 
 OBJ_DArray *mtl_create();
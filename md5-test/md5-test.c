@@ -13,6 +13,7 @@
 #include "fx.h"
 
 #include "md5.h"
+#include "loader.h"
 
 #define FENSTER_HEADER
 #include "fenster.h"
@@ -34,6 +35,17 @@ void load_shader(char *shader_name, char * file) {
 	md5_set_shader(shader_name, texture);
 }
 
+/* Called from `ld_update()` once a texture is loaded in the background;
+`udata` is the name of the shader. The model is drawn untextured until then. */
+static void texture_loaded(LD_JOB *job, void *data, void *udata) {
+	const char *name = udata;
+	if(!data) {
+		error("Unable to load texture for '%s'", name);
+		return;
+	}
+	md5_set_shader(name, data);
+}
+
 int init_thing(int argc, char *argv[]) {
 
 	fx_error = error;
@@ -62,16 +74,14 @@ int init_thing(int argc, char *argv[]) {
 	}
 	info("md5 animation loaded");
 
+	ld_init(-1);
 	for(int i = 0; i < md5->numMeshes; i++) {
-		const char *name = md5->meshes[i].shader;
-		Bitmap *texture = bm_loadf("%s.tga", name);
-		if(!texture) {
-			error("Unable to load texture for '%s'", name);
-			continue;
-		}
-		md5_set_shader(name, texture);
+		char *name = md5->meshes[i].shader;
+		char file[256];
+		snprintf(file, sizeof file, "%s.tga", name);
+		ld_release(ld_bitmap(file, texture_loaded, name));
 	}
-	info("md5 textures loaded");
+	info("md5 textures loading");
 #elif 0
 	md5 = md5_load_mesh("md5-test/md5/bob_lamp_update/bob_lamp_update.md5mesh");
 	if(!md5) {
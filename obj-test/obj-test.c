@@ -30,6 +30,7 @@ static Bitmap *tex = NULL;
 static Bitmap *pick_buffer = NULL;
 
 OBJ_MESH *obj = NULL;
+OBJ_RENDER_MESH *rmesh = NULL;
 
 int init_thing(int argc, char *argv[]) {
 
@@ -46,6 +47,10 @@ int init_thing(int argc, char *argv[]) {
 
 	obj_normalize_size(obj);
 
+	/* Compiling the mesh triangulates it and sorts it into
+	batches by material, which is a lot quicker to draw */
+	rmesh = obj_compile(obj);
+
 	if(argc > 2) {
 		tex = bm_load(argv[2]);
 		if(!tex) {
@@ -103,6 +108,7 @@ void deinit_thing()  {
 	fx_cleanup();
 	bm_free(tex);
 	bm_free(pick_buffer);
+	obj_compiled_free(rmesh);
 	if(obj) {
 		obj_free(obj);
 	}
@@ -181,7 +187,7 @@ void update_screen(int64_t ms) {
 	fx_set_diffuse_direction(0, -0.5, -1.0, -0.5);
 	fx_set_diffuse_color(0, 0.8, 0.8, 0.8);
 
-	obj_draw(obj);
+	obj_draw_compiled(rmesh);
 
 	if(key_pressed(KEY_ESCAPE)) {
 		quit = 1;
@@ -1,41 +1,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 #include "bmph.h"
 #include "fx.h"
 #include "bm_cache.h"
 
-#define HASH_SIZE   8
+/* An open addressing hash table with linear probing, that doubles when it
+ * gets half full. The entries that hold a bitmap are also kept on a list
+ * from the most to the least recently used, which is where evictions start.
+ *
+ * Interned names get an entry that is never removed, so that their handle
+ * can index an array of entries. Evicting one only releases its bitmap. */
+
+#define INITIAL_SIZE    16
 
 struct HashElement {
     char *name;
+    unsigned int hash;
     Bitmap *value;
-    struct HashElement *next;
+    size_t bytes;
+    int locks;
+    int handle;                         /* -1 if not interned */
+    struct HashElement *prev, *next;    /* LRU list */
 };
 
 typedef struct HashElement HashElement;
 
 struct BmCache {
-    HashElement *table[HASH_SIZE];
+    HashElement **table;
+    unsigned int size;
+
+    HashElement *head, *tail;   /* Most and least recently used */
+
+    HashElement **handles;
+    int nhandles, ahandles;
+
+    int nentries;               /* Including interned names without bitmaps */
+
+    size_t budget;
+    bc_loader_fn load;
+    void *udata;
+
+    BcStats stats;
 };
 
 BmCache *bc_create() {
     BmCache *ht = fx_calloc(1, sizeof *ht);
+    ht->size = INITIAL_SIZE;
+    ht->table = fx_calloc(ht->size, sizeof *ht->table);
     return ht;
 }
 
-void bc_destroy(BmCache *ht) {
-    int i;
-    for(i = 0; i < HASH_SIZE; i++) {
-        while(ht->table[i]) {
-            HashElement* v = ht->table[i];
-            ht->table[i] = v->next;
-            free(v->name);
-            bm_release(v->value);
-            free(v);
-        }
+static void free_element(HashElement *v) {
+    free(v->name);
+    if(v->value) {
+        /* fx caches the mipmaps of textures by their address */
+        fx_texture_changed(v->value);
+        bm_release(v->value);
     }
+    free(v);
+}
+
+void bc_destroy(BmCache *ht) {
+    unsigned int i;
+    for(i = 0; i < ht->size; i++)
+        if(ht->table[i])
+            free_element(ht->table[i]);
+    free(ht->table);
+    free(ht->handles);
     free(ht);
 }
 
@@ -47,56 +81,222 @@ static unsigned int hash(const char *s) {
     return h;
 }
 
-Bitmap *bc_put(BmCache *ht, const char *name, Bitmap *b) {
-    unsigned int h = hash(name) & (HASH_SIZE - 1);
+static size_t bitmap_bytes(Bitmap *b) {
+    return b ? (size_t)bm_width(b) * bm_height(b) * 4 : 0;
+}
+
+/* Returns the slot of `name`, or the empty slot where it would go */
+static unsigned int find_slot(BmCache *ht, const char *name, unsigned int h) {
+    unsigned int i = h & (ht->size - 1);
     HashElement *v;
-    for(v = ht->table[h]; v; v = v->next)
-        if(!strcmp(v->name, name)) {
-            bm_release(v->value);
-            v->value = bm_retain(b);
-            return b;
+    while((v = ht->table[i]) && (v->hash != h || strcmp(v->name, name)))
+        i = (i + 1) & (ht->size - 1);
+    return i;
+}
+
+static void grow(BmCache *ht) {
+    HashElement **old = ht->table;
+    unsigned int i, n = ht->size;
+    ht->size *= 2;
+    ht->table = fx_calloc(ht->size, sizeof *ht->table);
+    for(i = 0; i < n; i++)
+        if(old[i])
+            ht->table[find_slot(ht, old[i]->name, old[i]->hash)] = old[i];
+    free(old);
+}
+
+static void lru_unlink(BmCache *ht, HashElement *v) {
+    if(v->prev)
+        v->prev->next = v->next;
+    else
+        ht->head = v->next;
+    if(v->next)
+        v->next->prev = v->prev;
+    else
+        ht->tail = v->prev;
+    v->prev = v->next = NULL;
+}
+
+static void lru_push(BmCache *ht, HashElement *v) {
+    v->prev = NULL;
+    v->next = ht->head;
+    if(ht->head)
+        ht->head->prev = v;
+    else
+        ht->tail = v;
+    ht->head = v;
+}
+
+/* Removes the element in slot `i`, shifting back the elements after it
+ * that were displaced past the hole, so that probing doesn't stop early. */
+static void remove_slot(BmCache *ht, unsigned int i) {
+    HashElement *v = ht->table[i];
+    unsigned int j = i, mask = ht->size - 1;
+    ht->table[i] = NULL;
+    for(;;) {
+        j = (j + 1) & mask;
+        if(!ht->table[j])
+            break;
+        unsigned int k = ht->table[j]->hash & mask;
+        /* Move it if its home slot `k` is not cyclically in (i, j] */
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        ht->table[i] = ht->table[j];
+        ht->table[j] = NULL;
+        i = j;
+    }
+    if(v->value) {
+        lru_unlink(ht, v);
+        ht->stats.count--;
+        ht->stats.bytes -= v->bytes;
+    }
+    ht->nentries--;
+    free_element(v);
+}
+
+static HashElement *set_value(BmCache *ht, HashElement *v, Bitmap *b);
+
+/* Evicts the least recently used bitmaps until the cache is within budget */
+static void evict(BmCache *ht, HashElement *keep) {
+    HashElement *v = ht->tail;
+    while(ht->budget && ht->stats.bytes > ht->budget && v) {
+        HashElement *prev = v->prev;
+        if(v != keep && !v->locks) {
+            if(v->handle >= 0)
+                set_value(ht, v, NULL);
+            else
+                remove_slot(ht, find_slot(ht, v->name, v->hash));
+            ht->stats.evictions++;
         }
+        v = prev;
+    }
+}
 
-    v = fx_malloc(sizeof *v);
+/* Creates an entry for `name` without a bitmap, if it doesn't have one */
+static HashElement *find_or_add(BmCache *ht, const char *name) {
+    unsigned int h = hash(name), i = find_slot(ht, name, h);
+    if(ht->table[i])
+        return ht->table[i];
+    if(2 * (ht->nentries + 1) > ht->size) {
+        grow(ht);
+        i = find_slot(ht, name, h);
+    }
+    HashElement *v = fx_calloc(1, sizeof *v);
     v->name = strdup(name);
-    v->next = ht->table[h];
-    v->value = bm_retain(b);
-    ht->table[h] = v;
+    v->hash = h;
+    v->handle = -1;
+    ht->table[i] = v;
+    ht->nentries++;
+    return v;
+}
 
+static HashElement *set_value(BmCache *ht, HashElement *v, Bitmap *b) {
+    if(v->value) {
+        lru_unlink(ht, v);
+        ht->stats.count--;
+        ht->stats.bytes -= v->bytes;
+        if(v->value != b) {
+            fx_texture_changed(v->value);
+            bm_release(v->value);
+            bm_retain(b);
+        }
+    } else {
+        bm_retain(b);
+    }
+    v->value = b;
+    v->bytes = bitmap_bytes(b);
+    if(b) {
+        ht->stats.count++;
+        ht->stats.bytes += v->bytes;
+        lru_push(ht, v);
+        evict(ht, v);
+    }
+    return v;
+}
+
+static HashElement *insert(BmCache *ht, const char *name, Bitmap *b) {
+    return set_value(ht, find_or_add(ht, name), b);
+}
+
+Bitmap *bc_put(BmCache *ht, const char *name, Bitmap *b) {
+    insert(ht, name, b);
     return b;
 }
 
-Bitmap *bc_get(BmCache *ht, const char *name) {
-    unsigned int h = hash(name) & (HASH_SIZE - 1);
-    HashElement *v;
-    for(v = ht->table[h]; v; v = v->next)
-        if(!strcmp(v->name, name))
-            return v->value;
-    return NULL;
-}
-
-/*
-static const char *ht_next(BmCache *ht, const char *name) {
-    unsigned int h;
-    HashElement *e;
-    if(!name) {
-        for(h = 0; h < HASH_SIZE; h++) {
-            if((e = ht->table[h]))
-                return e->name;
+/* Marks `v` (which may be NULL) used, loading its bitmap on a miss if
+possible. Returns NULL if there is no bitmap. */
+static HashElement *use(BmCache *ht, HashElement *v, const char *name) {
+    if(v && v->value) {
+        ht->stats.hits++;
+        if(v != ht->head) {
+            lru_unlink(ht, v);
+            lru_push(ht, v);
         }
-    } else {
-        h = hash(name) & (HASH_SIZE - 1);
-        for(e = ht->table[h]; e; e = e->next) {
-            if(!strcmp(e->name, name)) {
-                if(e->next)
-                    return e->next->name;
-                for(h++; h < HASH_SIZE; h++) {
-                    if(ht->table[h])
-                        return ht->table[h]->name;
-                }
-            }
+        return v;
+    }
+    ht->stats.misses++;
+    if(!ht->load)
+        return NULL;
+    Bitmap *b = ht->load(name, ht->udata);
+    if(!b)
+        return NULL;
+    ht->stats.loads++;
+    return v ? set_value(ht, v, b) : insert(ht, name, b);
+}
+
+static HashElement *lookup(BmCache *ht, const char *name) {
+    return use(ht, ht->table[find_slot(ht, name, hash(name))], name);
+}
+
+Bitmap *bc_get(BmCache *ht, const char *name) {
+    HashElement *v = lookup(ht, name);
+    return v ? v->value : NULL;
+}
+
+int bc_intern(BmCache *ht, const char *name) {
+    HashElement *v = find_or_add(ht, name);
+    if(v->handle < 0) {
+        if(ht->nhandles == ht->ahandles) {
+            ht->ahandles = ht->ahandles ? 2 * ht->ahandles : 16;
+            ht->handles = fx_realloc(ht->handles, ht->ahandles * sizeof *ht->handles);
         }
+        v->handle = ht->nhandles++;
+        ht->handles[v->handle] = v;
     }
-    return NULL;
+    return v->handle;
+}
+
+Bitmap *bc_get_handle(BmCache *ht, int handle) {
+    assert(handle >= 0 && handle < ht->nhandles);
+    HashElement *v = use(ht, ht->handles[handle], ht->handles[handle]->name);
+    return v ? v->value : NULL;
+}
+
+void bc_set_budget(BmCache *ht, size_t bytes) {
+    ht->budget = bytes;
+    evict(ht, NULL);
+}
+
+void bc_set_loader(BmCache *ht, bc_loader_fn load, void *udata) {
+    ht->load = load;
+    ht->udata = udata;
+}
+
+Bitmap *bc_lock(BmCache *ht, const char *name) {
+    HashElement *v = lookup(ht, name);
+    if(!v)
+        return NULL;
+    v->locks++;
+    return v->value;
+}
+
+void bc_unlock(BmCache *ht, const char *name) {
+    HashElement *v = ht->table[find_slot(ht, name, hash(name))];
+    assert(v && v->locks > 0);
+    if(v && v->locks > 0 && !--v->locks)
+        evict(ht, NULL);
+}
+
+void bc_get_stats(BmCache *ht, BcStats *stats) {
+    *stats = ht->stats;
 }
-*/
@@ -0,0 +1,276 @@
+/* Background loading of models and textures.
+ * See loader.h for the details.
+ *
+ * Jobs wait in a FIFO queue for a worker thread. Once a job is loaded it
+ * moves to the list of completed jobs, which `ld_update()` empties on the
+ * main thread. A single mutex protects both lists and the jobs' state.
+ *
+ * Each job has two references: The caller's, which `ld_release()` drops,
+ * and the loader's, which is dropped after the job's callback has run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#  include <pthread.h>
+#endif
+
+#include "bmph.h"
+#include "fx.h"
+#include "obj.h"
+#include "md2.h"
+#include "mdl.h"
+#include "md5.h"
+#include "loader.h"
+
+#define MAX_THREADS 64
+
+struct LD_JOB {
+    ld_load_fn load;
+    /* Used instead of `load` by the loaders that need more than the
+    filename; `arg` is freed with the job */
+    void *(*load_arg)(const char *filename, void *arg);
+    void *arg;
+    char *filename;
+    ld_done_fn done;
+    void *udata;
+
+    void *data;
+    ld_status_t status;
+    int refs;
+
+    LD_JOB *next;
+};
+
+/* Jobs waiting for a thread */
+static LD_JOB *Queue = NULL, *QueueTail = NULL;
+
+/* Jobs waiting for `ld_update()` to run their callbacks */
+static LD_JOB *Completed = NULL, *CompletedTail = NULL;
+
+/* Jobs submitted whose callbacks haven't been run */
+static int Outstanding = 0;
+
+static int NThreads = 0;
+
+#ifndef _WIN32
+static pthread_t Threads[MAX_THREADS];
+static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WorkCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t DoneCond = PTHREAD_COND_INITIALIZER;
+static int Stopping = 0;
+#  define LOCK()    pthread_mutex_lock(&Mutex)
+#  define UNLOCK()  pthread_mutex_unlock(&Mutex)
+#else
+#  define LOCK()
+#  define UNLOCK()
+#endif
+
+static void unref(LD_JOB *job) {
+    if(--job->refs == 0) {
+        free(job->arg);
+        free(job->filename);
+        free(job);
+    }
+}
+
+/* Loads `job` and moves it to the completed list. Called without the lock. */
+static void run_job(LD_JOB *job) {
+    void *data = job->load_arg ? job->load_arg(job->filename, job->arg) : job->load(job->filename);
+    LOCK();
+    job->data = data;
+    job->status = data ? LD_DONE : LD_FAILED;
+    if(CompletedTail)
+        CompletedTail->next = job;
+    else
+        Completed = job;
+    CompletedTail = job;
+#ifndef _WIN32
+    pthread_cond_broadcast(&DoneCond);
+#endif
+    UNLOCK();
+}
+
+#ifndef _WIN32
+static void *worker(void *arg) {
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&Mutex);
+        while(!Queue && !Stopping)
+            pthread_cond_wait(&WorkCond, &Mutex);
+        LD_JOB *job = Queue;
+        if(!job) {
+            /* Only get here when stopping, with the queue drained */
+            pthread_mutex_unlock(&Mutex);
+            return NULL;
+        }
+        Queue = job->next;
+        if(!Queue)
+            QueueTail = NULL;
+        job->next = NULL;
+        pthread_mutex_unlock(&Mutex);
+
+        run_job(job);
+    }
+}
+#endif
+
+int ld_init(int nthreads) {
+#ifndef _WIN32
+    if(NThreads)
+        return NThreads;
+    if(nthreads < 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    Stopping = 0;
+    for(NThreads = 0; NThreads < nthreads; NThreads++) {
+        if(pthread_create(&Threads[NThreads], NULL, worker, NULL)) {
+            fx_error("LD: unable to create loader thread");
+            break;
+        }
+    }
+#else
+    (void)nthreads;
+#endif
+    return NThreads;
+}
+
+void ld_deinit(void) {
+#ifndef _WIN32
+    int i;
+    pthread_mutex_lock(&Mutex);
+    Stopping = 1;
+    pthread_cond_broadcast(&WorkCond);
+    pthread_mutex_unlock(&Mutex);
+    for(i = 0; i < NThreads; i++)
+        pthread_join(Threads[i], NULL);
+    NThreads = 0;
+#endif
+    /* Callbacks may submit more jobs, which are now loaded immediately */
+    while(ld_update() > 0);
+}
+
+static LD_JOB *submit(ld_load_fn load, void *(*load_arg)(const char *, void *), void *arg,
+        const char *filename, ld_done_fn done, void *udata) {
+    LD_JOB *job = fx_malloc(sizeof *job);
+    job->load = load;
+    job->load_arg = load_arg;
+    job->arg = arg;
+    job->filename = strdup(filename);
+    job->done = done;
+    job->udata = udata;
+    job->data = NULL;
+    job->status = LD_PENDING;
+    job->refs = 2;
+    job->next = NULL;
+
+    LOCK();
+    Outstanding++;
+    if(!NThreads) {
+        UNLOCK();
+        run_job(job);
+        return job;
+    }
+    if(QueueTail)
+        QueueTail->next = job;
+    else
+        Queue = job;
+    QueueTail = job;
+#ifndef _WIN32
+    pthread_cond_signal(&WorkCond);
+#endif
+    UNLOCK();
+    return job;
+}
+
+LD_JOB *ld_submit(ld_load_fn load, const char *filename, ld_done_fn done, void *udata) {
+    return submit(load, NULL, NULL, filename, done, udata);
+}
+
+static void *load_bitmap(const char *filename) { return bm_load(filename); }
+static void *load_obj(const char *filename) { return obj_load(filename); }
+static void *load_md2(const char *filename) { return md2_load(filename); }
+static void *load_mdl(const char *filename, void *settings) { return mdl_load_with(filename, settings); }
+static void *load_md5_mesh(const char *filename) { return md5_load_mesh(filename); }
+static void *load_md5_anim(const char *filename) { return md5_load_anim(filename); }
+
+LD_JOB *ld_bitmap(const char *filename, ld_done_fn done, void *udata) {
+    return ld_submit(load_bitmap, filename, done, udata);
+}
+
+LD_JOB *ld_obj(const char *filename, ld_done_fn done, void *udata) {
+    return ld_submit(load_obj, filename, done, udata);
+}
+
+LD_JOB *ld_md2(const char *filename, ld_done_fn done, void *udata) {
+    return ld_submit(load_md2, filename, done, udata);
+}
+
+LD_JOB *ld_mdl(const char *filename, ld_done_fn done, void *udata) {
+    /* The palette and skin settings as they are now, since they may
+    change before a worker gets to the job */
+    MDL_SETTINGS *settings = fx_malloc(sizeof *settings);
+    mdl_get_settings(settings);
+    return submit(NULL, load_mdl, settings, filename, done, udata);
+}
+
+LD_JOB *ld_md5_mesh(const char *filename, ld_done_fn done, void *udata) {
+    return ld_submit(load_md5_mesh, filename, done, udata);
+}
+
+LD_JOB *ld_md5_anim(const char *filename, ld_done_fn done, void *udata) {
+    return ld_submit(load_md5_anim, filename, done, udata);
+}
+
+ld_status_t ld_status(LD_JOB *job) {
+    LOCK();
+    ld_status_t status = job->status;
+    UNLOCK();
+    return status;
+}
+
+void *ld_wait(LD_JOB *job) {
+    LOCK();
+#ifndef _WIN32
+    while(job->status == LD_PENDING)
+        pthread_cond_wait(&DoneCond, &Mutex);
+#endif
+    void *data = job->data;
+    UNLOCK();
+    return data;
+}
+
+void ld_release(LD_JOB *job) {
+    if(!job)
+        return;
+    LOCK();
+    unref(job);
+    UNLOCK();
+}
+
+int ld_update(void) {
+    LOCK();
+    LD_JOB *job = Completed;
+    Completed = CompletedTail = NULL;
+    UNLOCK();
+
+    while(job) {
+        LD_JOB *next = job->next;
+        if(job->done)
+            job->done(job, job->data, job->udata);
+        LOCK();
+        Outstanding--;
+        unref(job);
+        UNLOCK();
+        job = next;
+    }
+
+    LOCK();
+    int n = Outstanding;
+    UNLOCK();
+    return n;
+}
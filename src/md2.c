@@ -425,7 +425,16 @@ double *md2_get_normal(int i) {
     return anorms[i];
 }
 
+#define NUM_NORMALS (sizeof anorms / sizeof anorms[0])
+
 #ifndef MD2_NODRAW
+/* The normals in the coordinate system the meshes are drawn in, and their
+ * colors under the current lights, which are looked up instead of lighting
+ * every vertex */
+static double draw_normals[NUM_NORMALS][3];
+static double normal_colors[NUM_NORMALS][3];
+static int draw_normals_ready = 0;
+
 void md2_draw(MD2_MESH *m, double frame) {
 	assert(frame >= 0 && frame < m->header.n_frames);
 	int f0 = (int)frame;
@@ -442,6 +451,17 @@ void md2_draw_interpolate(MD2_MESH *m, int frame0, int frame1, double frac) {
 	md2_frame *fr0 = &m->frames[frame0];
 	md2_frame *fr1 = &m->frames[frame1];
 
+	if(!draw_normals_ready) {
+		unsigned int k;
+		for(k = 0; k < NUM_NORMALS; k++) {
+			draw_normals[k][0] = anorms[k][0];
+			draw_normals[k][1] = anorms[k][2];
+			draw_normals[k][2] = -anorms[k][1];
+		}
+		draw_normals_ready = 1;
+	}
+	int lit = fx_light_normals(draw_normals[0], NUM_NORMALS, normal_colors[0]);
+
 #if 0
 	int i, j;
 	for(i = 0; i < m->header.n_tri; i++) {
@@ -511,11 +531,19 @@ void md2_draw_interpolate(MD2_MESH *m, int frame0, int frame1, double frac) {
 			/* MD2 does not use the same coordinate system as OpenGL */
 			fx_vertex(v0[1], v0[2], -v0[0]);
 
-            double *n0 = md2_get_normal(fr0->tris[index].normal_i);
-            double *n1 = md2_get_normal(fr1->tris[index].normal_i);
-            double n[3];
-			vec3_lerp(n0, n1, frac, n);
-			fx_normal(n[0], n[2], -n[1]);
+			if(lit) {
+				double *c0 = normal_colors[fr0->tris[index].normal_i];
+				double *c1 = normal_colors[fr1->tris[index].normal_i];
+				double c[3];
+				vec3_lerp(c0, c1, frac, c);
+				fx_color(c[0], c[1], c[2]);
+			} else {
+				double *n0 = md2_get_normal(fr0->tris[index].normal_i);
+				double *n1 = md2_get_normal(fr1->tris[index].normal_i);
+				double n[3];
+				vec3_lerp(n0, n1, frac, n);
+				fx_normal(n[0], n[2], -n[1]);
+			}
 		}
 		fx_end();
 	}
@@ -277,6 +277,7 @@ static int parse_mesh(Parser *p, MD5_MODEL *m) {
                return 0;
            }
            MD5_MESH *me = &m->meshes[mi];
+           me->texture = -1;
 
            if(!expect(p, '{')) return 0;
             while(!accept(p, '}')) {
@@ -681,6 +682,15 @@ void md5_set_shader(const char *shader_name, Bitmap *texture) {
     bc_put(md5_cache, shader_name, texture);
 }
 
+/* The shader's texture; The name is interned the first time the mesh is
+drawn rather than when it is loaded, because meshes can be loaded on
+other threads, and after that it's found by its handle. */
+static Bitmap *mesh_texture(MD5_MESH *me) {
+    if(me->texture < 0)
+        me->texture = bc_intern(md5_cache, me->shader);
+    return bc_get_handle(md5_cache, me->texture);
+}
+
 void md5_draw(MD5_MODEL *m) {
     int i, mi, wi;
 
@@ -688,13 +698,12 @@ void md5_draw(MD5_MODEL *m) {
         MD5_MESH *me = &m->meshes[mi];
 
         if(md5_cache) {
-            Bitmap *tex = bc_get(md5_cache, me->shader);
-            if(!tex) {
+            /* Drawn untextured until the shader's texture is set */
+            Bitmap *tex = mesh_texture(me);
 #if WARN_NO_TEXTURE
+            if(!tex)
                 fx_error("no texture for %s", me->shader);
 #endif
-                continue;
-            }
             fx_set_texture(tex);
         }
 
@@ -856,13 +865,12 @@ void md5_draw_frame(MD5_MODEL *m, MD5_ANIM *a, double frame) {
         MD5_MESH *me = &m->meshes[mi];
 
         if(md5_cache) {
-            Bitmap *tex = bc_get(md5_cache, me->shader);
-            if(!tex) {
+            /* Drawn untextured until the shader's texture is set */
+            Bitmap *tex = mesh_texture(me);
 #if WARN_NO_TEXTURE
+            if(!tex)
                 fx_error("no texture for %s", me->shader);
 #endif
-                continue;
-            }
             fx_set_texture(tex);
         }
 
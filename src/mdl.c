@@ -154,6 +154,8 @@ uint8_t mdl_hexen2_palette[] = {
 
 static uint8_t *palette = mdl_quake_palette;
 
+static int packed_skins = 0;
+
 void mdl_set_palette(uint8_t *pal) {
     if(pal)
         palette = pal;
@@ -161,7 +163,33 @@ void mdl_set_palette(uint8_t *pal) {
         palette = mdl_quake_palette;
 }
 
-static Bitmap *read_texture(FILE *f, int w, int h) {
+void mdl_packed_skins(int enabled) {
+    packed_skins = enabled;
+}
+
+void mdl_get_settings(MDL_SETTINGS *s) {
+    memcpy(s->palette, palette, sizeof s->palette);
+    s->packed_skins = packed_skins;
+}
+
+/* Reads a skin into a palettized FX_PACKED, without expanding it */
+static FX_PACKED *read_packed_texture(FILE *f, int w, int h, const uint8_t *palette) {
+    unsigned int colors[256];
+    FX_PACKED *p = NULL;
+    uint8_t *bytes = fx_calloc(h, w);
+    int i;
+    if(fread(bytes, w*h, 1, f) != 1) {
+        fx_error("MDL: couldn't read texture\n");
+    } else {
+        for(i = 0; i < 256; i++)
+            colors[i] = bm_rgb(palette[i*3], palette[i*3+1], palette[i*3+2]);
+        p = fx_pack_palette(w, h, bytes, colors, -1);
+    }
+    free(bytes);
+    return p;
+}
+
+static Bitmap *read_texture(FILE *f, int w, int h, const uint8_t *palette) {
     int x, y, i = 0;
     Bitmap *bmp = bm_create(w, h);
     uint8_t *bytes;
@@ -174,7 +202,7 @@ static Bitmap *read_texture(FILE *f, int w, int h) {
     }
     for(y = 0; y < h; y++) {
         for(x = 0; x < w; x++) {
-            uint8_t *rgb = palette + bytes[i++] * 3;
+            const uint8_t *rgb = palette + bytes[i++] * 3;
             unsigned int color = bm_rgb(rgb[0], rgb[1], rgb[2]);
             bm_set(bmp, x, y, color);
         }
@@ -227,7 +255,7 @@ static mdl_simpleframe *read_simple_frame(MDL_MESH *M, mdl_simpleframe *sframe,
     return sframe;
 }
 
-MDL_MESH *mdl_load(const char *filename) {
+static MDL_MESH *load_mdl(const char *filename, const uint8_t *palette, int packed_skins) {
     int i, j;
     MDL_MESH *M = fx_calloc(1, sizeof *M);
     if(!M) {
@@ -304,7 +332,8 @@ MDL_MESH *mdl_load(const char *filename) {
             return NULL;
         }
         skin->textures = fx_calloc(skin->num_textures, sizeof *skin->textures);
-        if(!skin->textures) {
+        skin->packed = fx_calloc(skin->num_textures, sizeof *skin->packed);
+        if(!skin->textures || !skin->packed) {
             fx_error("MDL: out of memory\n");
             return NULL;
         }
@@ -314,21 +343,25 @@ MDL_MESH *mdl_load(const char *filename) {
                 fx_error("MDL: unable to read times: %s\n", strerror(errno));
                 return NULL;
             }
-            for(i = 0; i < skin->num_textures; i++) {
-                skin->textures[i] = read_texture(f, M->header.skinwidth, M->header.skinheight);
+        } else {
+            skin->times[0] = 0;
+        }
+        for(i = 0; i < skin->num_textures; i++) {
+            if(packed_skins) {
+                skin->packed[i] = read_packed_texture(f, M->header.skinwidth, M->header.skinheight, palette);
+                if(!skin->packed[i])
+                    return NULL;
+            } else {
+                skin->textures[i] = read_texture(f, M->header.skinwidth, M->header.skinheight, palette);
                 if(!skin->textures[i])
                     return NULL;
             }
-        } else {
-            skin->times[0] = 0;
-            skin->textures[0] = read_texture(f, M->header.skinwidth, M->header.skinheight);
-            if(!skin->textures[0])
-                return NULL;
         }
 
 #if MDL_VERBOSE
         for(i = 0; i < skin->num_textures; i++) {
-            bm_savef(skin->textures[i], "skin-%d-%d.gif", j, i);
+            if(skin->textures[i])
+                bm_savef(skin->textures[i], "skin-%d-%d.gif", j, i);
             printf("Skin %d-%d. Time: %g\n", j, i, skin->times[i]);
         }
 #endif
@@ -456,6 +489,14 @@ MDL_MESH *mdl_load(const char *filename) {
     return M;
 }
 
+MDL_MESH *mdl_load(const char *filename) {
+    return load_mdl(filename, palette, packed_skins);
+}
+
+MDL_MESH *mdl_load_with(const char *filename, const MDL_SETTINGS *s) {
+    return load_mdl(filename, s->palette, s->packed_skins);
+}
+
 
 /* TODO: Maybe it would be better to scale the model by a specific frame, rather than all frames.
     Otherwise a model gets scaled too much (like the Quake Shambler holds its hands over its head
@@ -559,8 +600,14 @@ void mdl_free(MDL_MESH *m) {
     int i, j;
     for(i = 0; i < m->header.num_skins; i++) {
         mdl_skin *skin = &m->skins[i];
-        for(j = 0; j < skin->num_textures; j++)
+        for(j = 0; j < skin->num_textures; j++) {
+            if(skin->textures[j])
+                fx_texture_changed(skin->textures[j]);
             bm_free(skin->textures[j]);
+            fx_packed_free(skin->packed[j]);
+        }
+        free(skin->textures);
+        free(skin->packed);
         free(skin->times);
     }
     free(m->skins);
@@ -750,14 +797,36 @@ static double anorms[][3] = {
 { -0.688191f, -0.587785f, -0.425325f }
 };
 
+#define NUM_NORMALS (sizeof anorms / sizeof anorms[0])
+
+/* The normals in the coordinate system the meshes are drawn in, and their
+ * colors under the current lights, which are looked up instead of lighting
+ * every vertex */
+static double draw_normals[NUM_NORMALS][3];
+static double normal_colors[NUM_NORMALS][3];
+static int draw_normals_ready = 0;
 
 void mdl_draw_interpolate(MDL_MESH *m, int frame0, int frame1, double frac) {
     int i, j;
     mdl_simpleframe *fr0 = m->sframes[frame0];
     mdl_simpleframe *fr1 = m->sframes[frame1];
 
+    if(!draw_normals_ready) {
+        unsigned int k;
+        for(k = 0; k < NUM_NORMALS; k++) {
+            draw_normals[k][0] = anorms[k][0];
+            draw_normals[k][1] = anorms[k][2];
+            draw_normals[k][2] = anorms[k][1];
+        }
+        draw_normals_ready = 1;
+    }
+    int lit = fx_light_normals(draw_normals[0], NUM_NORMALS, normal_colors[0]);
+
     // TODO: Choose different skins and textures...
-    fx_set_texture(m->skins[0].textures[0]);
+    if(m->skins[0].packed[0])
+        fx_set_packed_texture(m->skins[0].packed[0]);
+    else
+        fx_set_texture(m->skins[0].textures[0]);
     fx_begin(FX_TRIANGLES);
     for(i = 0; i < m->header.num_tris; i++) {
         for(j = 0; j < 3; j++) {
@@ -775,9 +844,15 @@ void mdl_draw_interpolate(MDL_MESH *m, int frame0, int frame1, double frac) {
             t = (t + 0.5)/ m->header.skinheight;
             fx_texcoord(s,t);
 
-            double *no0 = anorms[vert0->normalIndex];
-            double *no1 = anorms[vert1->normalIndex];
-            fx_normal(no0[0] + frac * (no1[0] - no0[0]), no0[2] + frac * (no1[2] - no0[2]), no0[1] + frac * (no1[1] - no0[1]));
+            if(lit) {
+                double *c0 = normal_colors[vert0->normalIndex];
+                double *c1 = normal_colors[vert1->normalIndex];
+                fx_color(c0[0] + frac * (c1[0] - c0[0]), c0[1] + frac * (c1[1] - c0[1]), c0[2] + frac * (c1[2] - c0[2]));
+            } else {
+                double *no0 = anorms[vert0->normalIndex];
+                double *no1 = anorms[vert1->normalIndex];
+                fx_normal(no0[0] + frac * (no1[0] - no0[0]), no0[2] + frac * (no1[2] - no0[2]), no0[1] + frac * (no1[1] - no0[1]));
+            }
 
             double v[3];
             v[0] = m->header.scale[0] * (vert0->v[0] + frac * (vert1->v[0] - vert0->v[0])) + m->header.translate[0];
@@ -10,8 +10,11 @@
  *     # Compile:
  *     gcc -D OBJ_TEST -Wall obj.c fx.c bmp.c -lm
  *     gcc -D MTL_TEST -Wall obj.c fx.c bmp.c -lm
+ *     gcc -D OBJ_BENCH -O2 -Wall obj.c fx.c bmp.c -lm
  *     # Run:
  *     ./obj teapot.obj out.obj
+ *     ./obj [grid-size] [threads] # OBJ_BENCH: time loading a synthetic mesh
+ *                                 # from text and from `obj_save_binary()`
  *
  * Some tips for exporting from Blender:
  *
@@ -31,12 +34,25 @@
 #include <float.h>
 #include <errno.h>
 #include <assert.h>
-#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <pthread.h>
+#endif
 
-#ifdef OBJ_TEST
+#if defined(OBJ_TEST) || defined(OBJ_BENCH)
 #  define OBJ_NODRAW
 #endif
 
+#ifndef OBJ_NODRAW
+#  include "bmph.h"
+#  include "bm_cache.h"
+#endif
 #include "fx.h"
 #include "obj.h"
 
@@ -54,6 +70,8 @@ static OBJ_MTL WhiteMtl = {
 	1.0,			 // d
 	0,				 // illum
 	NULL,			 // map_Kd
+	-1,				 // texture
+	0,				 // texture_serial
 };
 
 typedef struct OBJ_DArray {
@@ -62,6 +80,7 @@ typedef struct OBJ_DArray {
     unsigned int a; /* Allocated number of elements */
     char *els;      /* Actual elements */
     void (*dtor)(void* p);  /* Destructor */
+    int borrowed;   /* `els` belongs to someone else, like a mapped file */
 } OBJ_DArray;
 
 static OBJ_DArray *al_create(size_t esize) {
@@ -71,9 +90,30 @@ static OBJ_DArray *al_create(size_t esize) {
 	al->els = fx_calloc(al->a, esize);
 	al->n = 0;
     al->dtor = NULL;
+	al->borrowed = 0;
 	return al;
 }
 
+/* Makes `al` use `n` elements at `els` in place, without copying them */
+static void al_borrow(OBJ_DArray *al, void *els, unsigned int n) {
+	if(!al->borrowed)
+		free(al->els);
+	al->els = els;
+	al->n = al->a = n;
+	al->borrowed = 1;
+}
+
+/* Copies borrowed elements before `al` is modified */
+static void al_own(OBJ_DArray *al) {
+	if(!al->borrowed)
+		return;
+	char *els = al->els;
+	al->a = al->n < 8 ? 8 : al->n;
+	al->els = fx_malloc(al->a * al->esize);
+	memcpy(al->els, els, al->n * al->esize);
+	al->borrowed = 0;
+}
+
 static void *al_get(OBJ_DArray *al, unsigned int i) {
 	assert(i >= 0 && i < al->n);
 	return al->els + i * al->esize;
@@ -85,11 +125,13 @@ static void al_free(OBJ_DArray *al) {
         for(i = 0; i < al->n; i++)
             al->dtor(al_get(al, i));
     }
-	free(al->els);
+	if(!al->borrowed)
+		free(al->els);
 	free(al);
 }
 
 static void *al_add(OBJ_DArray *al) {
+	al_own(al);
 	if(al->n == al->a) {
 		al->a <<= 1;
 		al->els = fx_realloc(al->els, al->a * al->esize);
@@ -100,9 +142,208 @@ static void *al_add(OBJ_DArray *al) {
 
 #define al_size(x) ((x)->n)
 
+/* Maps a file into memory. Writable mappings are private, so writes go to
+ * copy-on-write pages and never back to the file. Where `mmap()` is not
+ * available, the file is read into memory instead.
+ */
+static char *map_file(const char *filename, size_t *len, int writable) {
+#ifdef _WIN32
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	rewind(f);
+	char *data = fx_malloc(*len + 1);
+	if(fread(data, 1, *len, f) != *len) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	(void)writable;
+	return data;
+#else
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	if(*len == 0) {
+		close(fd);
+		return "";
+	}
+	void *data = mmap(NULL, *len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+#  ifdef MADV_SEQUENTIAL
+	if(!writable)
+		madvise(data, *len, MADV_SEQUENTIAL);
+#  endif
+	return data;
+#endif
+}
+
+static void unmap_file(const char *data, size_t len) {
+#ifdef _WIN32
+	(void)len;
+	free((char *)data);
+#else
+	if(len > 0)
+		munmap((void *)data, len);
+#endif
+}
+
+
+/* Hash table of indices into an OBJ_DArray of vectors, used to find
+ * existing elements in `obj_vert_at()` and friends in constant time.
+ *
+ * Vectors are hashed on the grid cell they fall into, with cells of size
+ * `eps`; A match can then only be in the same cell or a neighbouring one.
+ * If `eps` is 0 the hash is on the exact values instead.
+ * It uses open addressing with linear probing.
+ */
+typedef struct OBJ_Hash {
+	OBJ_DArray *al;
+	int dims;
+	double eps;
+	int *slots;         /* Indices into `al`, or -1 if the slot is empty */
+	unsigned int size;  /* Always a power of 2 */
+	unsigned int count;
+} OBJ_Hash;
+
+static uint64_t hash_key(double x, double eps) {
+	uint64_t k;
+	if(eps > 0)
+		return (uint64_t)(int64_t)floor(x / eps);
+	if(x == 0)
+		x = 0; /* -0.0 == 0.0 */
+	memcpy(&k, &x, sizeof k);
+	return k;
+}
+
+static unsigned int hash_cell(const uint64_t *cell, int dims) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+	for(i = 0; i < dims; i++) {
+		h ^= cell[i];
+		h *= 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 29;
+	}
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+static void hash_insert(OBJ_Hash *h, int index);
+
+static OBJ_Hash *hash_create(OBJ_DArray *al, int dims, double eps) {
+	int i;
+	OBJ_Hash *h = fx_malloc(sizeof *h);
+	h->al = al;
+	h->dims = dims;
+	h->eps = eps;
+	h->count = 0;
+	h->size = 64;
+	while(h->size < al_size(al) * 2)
+		h->size <<= 1;
+	h->slots = fx_malloc(h->size * sizeof *h->slots);
+	memset(h->slots, 0xFF, h->size * sizeof *h->slots);
+	for(i = 0; i < al_size(al); i++)
+		hash_insert(h, i);
+	return h;
+}
+
+static void hash_free(OBJ_Hash *h) {
+	if(!h)
+		return;
+	free(h->slots);
+	free(h);
+}
+
+static void hash_put(OBJ_Hash *h, int index) {
+	uint64_t cell[3];
+	int i;
+	numeric_t *v = al_get(h->al, index);
+	for(i = 0; i < h->dims; i++)
+		cell[i] = hash_key(v[i], h->eps);
+	unsigned int s = hash_cell(cell, h->dims) & (h->size - 1);
+	while(h->slots[s] >= 0)
+		s = (s + 1) & (h->size - 1);
+	h->slots[s] = index;
+	h->count++;
+}
+
+static void hash_insert(OBJ_Hash *h, int index) {
+	if(h->count * 2 >= h->size) {
+		unsigned int i, size = h->size;
+		int *slots = h->slots;
+		h->size <<= 1;
+		h->slots = fx_malloc(h->size * sizeof *h->slots);
+		memset(h->slots, 0xFF, h->size * sizeof *h->slots);
+		h->count = 0;
+		for(i = 0; i < size; i++)
+			if(slots[i] >= 0)
+				hash_put(h, slots[i]);
+		free(slots);
+	}
+	hash_put(h, index);
+}
+
+static int hash_probe(OBJ_Hash *h, const uint64_t *cell, const numeric_t *v) {
+	int i;
+	unsigned int s = hash_cell(cell, h->dims) & (h->size - 1);
+	for(; h->slots[s] >= 0; s = (s + 1) & (h->size - 1)) {
+		numeric_t *e = al_get(h->al, h->slots[s]);
+		for(i = 0; i < h->dims; i++) {
+			/* I know about floating point comparisons, but in the exact
+			mode this is meant for generated geometry, so I should be okay */
+			if(h->eps > 0 ? fabs(e[i] - v[i]) > h->eps : e[i] != v[i])
+				break;
+		}
+		if(i == h->dims)
+			return h->slots[s];
+	}
+	return -1;
+}
+
+/* Finds an element within `eps` of `v`, or -1 if there isn't one */
+static int hash_find(OBJ_Hash *h, const numeric_t *v) {
+	uint64_t cell[3], c[3];
+	int i, n, found;
+	for(i = 0; i < h->dims; i++)
+		cell[i] = hash_key(v[i], h->eps);
+	if(h->eps <= 0)
+		return hash_probe(h, cell, v);
+
+	/* Try the cell itself first, then its neighbours */
+	if((found = hash_probe(h, cell, v)) >= 0)
+		return found;
+	int ncells = h->dims == 3 ? 27 : 9;
+	for(n = 0; n < ncells; n++) {
+		int k = n, centre = 1;
+		for(i = 0; i < h->dims; i++, k /= 3) {
+			c[i] = cell[i] + (k % 3) - 1;
+			if(k % 3 != 1)
+				centre = 0;
+		}
+		if(!centre && (found = hash_probe(h, c, v)) >= 0)
+			return found;
+	}
+	return -1;
+}
+
 static void free_face(void *p) {
 	OBJ_FACE *f = p;
-	free(f->fv);
+	if(f->a)
+		free(f->fv);
+}
+
+static void free_group(void *p) {
+	free(*(char **)p);
 }
 
 OBJ_MESH *obj_create() {
@@ -112,12 +353,19 @@ OBJ_MESH *obj_create() {
 	m->texs = al_create(3 * sizeof(numeric_t));
 	m->faces = al_create(sizeof(OBJ_FACE));
 	m->faces->dtor = free_face;
+	m->fv = NULL;
+	m->fo = NULL;
 
 	m->groups = al_create(sizeof(char *));
-    m->groups->dtor = free;
+    m->groups->dtor = free_group;
 
 	m->name = NULL;
 
+	m->vhash = m->nhash = m->thash = NULL;
+	m->weld_epsilon = 0;
+	m->bin = NULL;
+	m->bin_len = 0;
+
 	m->xmin = DBL_MAX; m->xmax = DBL_MIN;
 	m->ymin = DBL_MAX; m->ymax = DBL_MIN;
 	m->zmin = DBL_MAX; m->zmax = DBL_MIN;
@@ -130,15 +378,28 @@ OBJ_MESH *obj_create() {
 	return m;
 }
 
+/* Is `m->fv` in the file mapped by `obj_load_binary()`? */
+static int fv_mapped(OBJ_MESH *m) {
+	return m->bin && (char *)m->fv >= m->bin && (char *)m->fv < m->bin + m->bin_len;
+}
+
 void obj_free(OBJ_MESH *m) {
 	al_free(m->verts);
 	al_free(m->norms);
 	al_free(m->texs);
 	al_free(m->faces);
+	if(!fv_mapped(m))
+		free(m->fv);
+	free(m->fo);
 	al_free(m->groups);
 	if(m->name)
 		free(m->name);
 	mtl_free(m->materials);
+	hash_free(m->vhash);
+	hash_free(m->nhash);
+	hash_free(m->thash);
+	if(m->bin)
+		unmap_file(m->bin, m->bin_len);
 	free(m);
 }
 
@@ -146,16 +407,41 @@ int obj_nfaces(OBJ_MESH *m) {
     return m->faces->n;
 }
 
+/* Fills in `m->fo` for a mesh whose faces are all in `m->fv`, in order */
+static void set_offsets(OBJ_MESH *m) {
+	int i, nfaces = al_size(m->faces);
+	m->fo = fx_realloc(m->fo, (nfaces + 1) * sizeof *m->fo);
+	m->fo[0] = 0;
+	for(i = 0; i < nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		assert(!face->a && (!face->n || face->fv == m->fv + m->fo[i]));
+		m->fo[i + 1] = m->fo[i] + face->n;
+	}
+}
+
+/* The caller may change the faces, which `m->fo` wouldn't follow */
+static void drop_offsets(OBJ_MESH *m) {
+	free(m->fo);
+	m->fo = NULL;
+}
+
 OBJ_FACE *obj_face(OBJ_MESH *m, int n) {
     assert(n < m->faces->n);
+    drop_offsets(m);
     return al_get(m->faces, n);
 }
 
+/* The vertices of face `n`, through `m->fo` while the mesh is packed */
+static OBJ_FACE_VERTEX *face_vertices(OBJ_MESH *m, OBJ_FACE *face, int n) {
+	return m->fo ? m->fv + m->fo[n] : face->fv;
+}
+
 int obj_new_face(OBJ_MESH *m) {
+	drop_offsets(m);
 	int n = al_size(m->faces);
 	OBJ_FACE *f = al_add(m->faces);
-	f->a = 4;
-	f->fv = fx_calloc(f->a, sizeof *f->fv);
+	f->a = 0;
+	f->fv = NULL;
 	f->n = 0;
 	f->m = 0;
 	f->s = 0;
@@ -164,7 +450,15 @@ int obj_new_face(OBJ_MESH *m) {
 }
 
 int obj_face_add_vertex(OBJ_FACE *face, int v, int vt, int vn) {
-	if(face->n == face->a) {
+	if(!face->a) {
+		/* The face's vertices are in the packed array, or there aren't
+		any yet, so it gets its own copy */
+		OBJ_FACE_VERTEX *fv = face->fv;
+		face->a = face->n < 4 ? 4 : face->n << 1;
+		face->fv = fx_malloc(face->a * sizeof *face->fv);
+		if(face->n)
+			memcpy(face->fv, fv, face->n * sizeof *face->fv);
+	} else if(face->n == face->a) {
 		face->a <<= 1;
 		face->fv = fx_realloc(face->fv, face->a * sizeof *face->fv);
 	}
@@ -176,6 +470,49 @@ int obj_face_add_vertex(OBJ_FACE *face, int v, int vt, int vn) {
 	return n;
 }
 
+void obj_pack(OBJ_MESH *m) {
+	int i, nfv = 0, nmtl = al_size(m->materials);
+	int nfaces = al_size(m->faces);
+
+	/* Counting sort on the material, which keeps the faces
+	in their original order within each material */
+	int *start = fx_calloc(nmtl + 1, sizeof *start);
+	for(i = 0; i < nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		assert(face->m >= 0 && face->m < nmtl);
+		start[face->m + 1]++;
+		nfv += face->n;
+	}
+	for(i = 0; i < nmtl; i++)
+		start[i + 1] += start[i];
+
+	OBJ_FACE *faces = fx_malloc((nfaces ? nfaces : 1) * sizeof *faces);
+	for(i = 0; i < nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		faces[start[face->m]++] = *face;
+	}
+	free(start);
+
+	OBJ_FACE_VERTEX *fv = fx_malloc((nfv ? nfv : 1) * sizeof *fv), *p = fv;
+	for(i = 0; i < nfaces; i++) {
+		OBJ_FACE *face = &faces[i];
+		memcpy(p, face->fv, face->n * sizeof *p);
+		if(face->a)
+			free(face->fv);
+		face->fv = p;
+		face->a = 0;
+		p += face->n;
+	}
+	if(nfaces)
+		memcpy(m->faces->els, faces, nfaces * sizeof *faces);
+	free(faces);
+
+	if(!fv_mapped(m))
+		free(m->fv);
+	m->fv = fv;
+	set_offsets(m);
+}
+
 int obj_nverts(OBJ_MESH *m) {
     return m->verts->n;
 }
@@ -191,19 +528,17 @@ int obj_new_vert(OBJ_MESH *m, numeric_t x, numeric_t y, numeric_t z) {
 	o[0] = x;
 	o[1] = y;
 	o[2] = z;
+	if(m->vhash)
+		hash_insert(m->vhash, n);
 	return n;
 }
 
 int obj_vert_at(OBJ_MESH *m, numeric_t x, numeric_t y, numeric_t z) {
-	int i, n = al_size(m->verts);
-	for(i = 0; i < n; i++) {
-		vec3_t v = al_get(m->verts, i);
-		/* I know about floating point comparisons, but this is meant for
-		generated geometry, so I should be okay */
-		if(v[0] == x && v[1] == y && v[2] == z)
-			return i;
-	}
-	return obj_new_vert(m, x, y, z);
+	numeric_t v[] = {x, y, z};
+	if(!m->vhash)
+		m->vhash = hash_create(m->verts, 3, m->weld_epsilon);
+	int i = hash_find(m->vhash, v);
+	return i >= 0 ? i : obj_new_vert(m, x, y, z);
 }
 
 int obj_norms(OBJ_MESH *m) {
@@ -220,17 +555,17 @@ int obj_new_norm(OBJ_MESH *m, numeric_t x, numeric_t y, numeric_t z) {
 	o[0] = x;
 	o[1] = y;
 	o[2] = z;
+	if(m->nhash)
+		hash_insert(m->nhash, n);
 	return n;
 }
 
 int obj_norm_at(OBJ_MESH *m, numeric_t x, numeric_t y, numeric_t z) {
-	int i, n = al_size(m->norms);
-	for(i = 0; i < n; i++) {
-		vec3_t v = al_get(m->norms, i);
-		if(v[0] == x && v[1] == y && v[2] == z)
-			return i;
-	}
-	return obj_new_norm(m, x, y, z);
+	numeric_t v[] = {x, y, z};
+	if(!m->nhash)
+		m->nhash = hash_create(m->norms, 3, m->weld_epsilon);
+	int i = hash_find(m->nhash, v);
+	return i >= 0 ? i : obj_new_norm(m, x, y, z);
 }
 
 int obj_ntexs(OBJ_MESH *m) {
@@ -248,17 +583,25 @@ int obj_new_tex(OBJ_MESH *m, numeric_t u, numeric_t v) {
 	o[0] = u;
 	o[1] = v;
 	o[2] = 0;
+	if(m->thash)
+		hash_insert(m->thash, n);
 	return n;
 }
 
 int obj_tex_at(OBJ_MESH *m, numeric_t u, numeric_t v) {
-	int i, n = al_size(m->texs);
-	for(i = 0; i < n; i++) {
-		vec3_t t = al_get(m->texs, i);
-		if(t[0] == u && t[1] == v)
-			return i;
-	}
-	return obj_new_tex(m, u, v);
+	numeric_t t[] = {u, v};
+	if(!m->thash)
+		m->thash = hash_create(m->texs, 2, m->weld_epsilon);
+	int i = hash_find(m->thash, t);
+	return i >= 0 ? i : obj_new_tex(m, u, v);
+}
+
+void obj_weld_epsilon(OBJ_MESH *m, double epsilon) {
+	m->weld_epsilon = epsilon;
+	hash_free(m->vhash);
+	hash_free(m->nhash);
+	hash_free(m->thash);
+	m->vhash = m->nhash = m->thash = NULL;
 }
 
 static char *tokenize(char *str, const char *delim, char **save) {
@@ -305,218 +648,566 @@ error:
 	return NULL;
 }
 
-OBJ_MESH *obj_load(const char *filename) {
-	OBJ_MESH *m;
+/* The loader scans the whole OBJ file in place, rather than going through
+ * `fgets()`/`atof()`. This keeps it fast on large scans, removes any limit
+ * on the line length and makes the number parsing independent of the
+ * current locale.
+ */
+#define IS_DIGIT(c) ((unsigned)((c) - '0') < 10)
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+static const double Pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-	char savepath[256];
-	getcwd(savepath, sizeof savepath);
+/* Scans a floating point number at `p`.
+ * Returns a pointer past the number, or NULL if there isn't one.
+ * Up to 19 significant digits are kept. When the mantissa fits in 53 bits
+ * and the exponent is at most 22 (which is practically always the case in
+ * OBJ files) the result is exact, because both the mantissa and the power
+ * of 10 can be represented exactly as doubles. Otherwise it may be off by
+ * an ulp, which is fine for geometry.
+ */
+static const char *scan_double(const char *p, const char *end, double *out) {
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0, neg = 0, any = 0;
+
+	if(p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+
+	for(; p < end && IS_DIGIT(*p); p++, any = 1) {
+		if(digits < 19) {
+			mant = mant * 10 + (*p - '0');
+			if(mant) digits++;
+		} else
+			exp10++;
+	}
+	if(p < end && *p == '.') {
+		for(p++; p < end && IS_DIGIT(*p); p++, any = 1) {
+			if(digits < 19) {
+				mant = mant * 10 + (*p - '0');
+				if(mant) digits++;
+				exp10--;
+			}
+		}
+	}
+	if(!any)
+		return NULL;
 
-	char filedir[256];
-	strncpy(filedir, filename, sizeof filedir);
-	char *delim = strrchr(filedir, '/');
-	if(delim) {
-		*delim = '\0';
-		filename = delim + 1;
-		//printf("changing to directory %s", filedir);
-		chdir(filedir);
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		int eneg = 0, e = 0;
+		if(q < end && (*q == '-' || *q == '+'))
+			eneg = (*q++ == '-');
+		if(q < end && IS_DIGIT(*q)) {
+			for(; q < end && IS_DIGIT(*q); q++)
+				if(e < 10000)
+					e = e * 10 + (*q - '0');
+			exp10 += eneg ? -e : e;
+			p = q;
+		}
 	}
 
-	FILE *f = fopen(filename, "r");
-	if(!f) {
-        fx_error("OBJ: couldn't open '%s': %s", filename, strerror(errno));
+	double v = (double)mant;
+	if(mant) {
+		if(exp10 < 0) {
+			if(exp10 >= -22)
+				v /= Pow10[-exp10];
+			else
+				v *= pow(10.0, exp10);
+		} else if(exp10 > 0) {
+			if(exp10 <= 22)
+				v *= Pow10[exp10];
+			else
+				v *= pow(10.0, exp10);
+		}
+	}
+	*out = neg ? -v : v;
+	return p;
+}
+
+static const char *scan_int(const char *p, const char *end, int *out) {
+	int neg = 0, v = 0;
+	if(p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	if(p >= end || !IS_DIGIT(*p))
 		return NULL;
+	for(; p < end && IS_DIGIT(*p); p++)
+		v = v * 10 + (*p - '0');
+	*out = neg ? -v : v;
+	return p;
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+	while(p < end && IS_BLANK(*p)) p++;
+	return p;
+}
+
+static const char *end_of_line(const char *p, const char *end) {
+	const char *e = memchr(p, '\n', end - p);
+	return e ? e : end;
+}
+
+/* Scans `n` numbers from `p` into `v`; returns NULL if there aren't enough */
+static const char *scan_vec(const char *p, const char *end, int n, double *v) {
+	int i;
+	for(i = 0; i < n; i++) {
+		p = skip_blanks(p, end);
+		if(!(p = scan_double(p, end, &v[i])))
+			return NULL;
 	}
-	m = obj_create();
-	char buffer[256], *str, *save, *word, *current_group = NULL;
-    int smoothing_group = 0;
+	return p;
+}
 
-	int current_mtl = 0;
+/* Scans a face vertex in the form `v`, `v/vt`, `v//vn` or `v/vt/vn`.
+ * The indices are returned as they appear in the file, and indices that
+ * are absent are set to 0 (which is not a valid index in an OBJ file).
+ */
+static const char *scan_face_vertex(const char *p, const char *end, int idx[3]) {
+	idx[0] = idx[1] = idx[2] = 0;
+	if(!(p = scan_int(p, end, &idx[0])))
+		return NULL;
+	if(p < end && *p == '/') {
+		p++;
+		if(p < end && *p != '/') {
+			if(!(p = scan_int(p, end, &idx[1])))
+				return NULL;
+		}
+		if(p < end && *p == '/') {
+			if(!(p = scan_int(p + 1, end, &idx[2])))
+				return NULL;
+		}
+	}
+	if(p < end && !IS_BLANK(*p) && *p != '\n')
+		return NULL;
+	return p;
+}
 
-	while(fgets(buffer, sizeof buffer, f)) {
-		str = buffer;
-		int i;
-		while(isspace(*str)) str++;
-		if(str[0] == '\0' || str[0] == '#')
+/* Duplicates the rest of the line at `p`, without trailing whitespace */
+static char *dup_rest_of_line(const char *p, const char *end) {
+	const char *e = end_of_line(p, end);
+	while(e > p && IS_BLANK(e[-1])) e--;
+	char *s = fx_malloc(e - p + 1);
+	memcpy(s, p, e - p);
+	s[e - p] = '\0';
+	return s;
+}
+
+/* Resolves an index from the file to an index into an array of size `n`.
+ * Negative indices count from the end of the array. */
+static int resolve_index(int a, int n) {
+	return a < 0 ? n + a : a - 1;
+}
+
+static int find_material(OBJ_MESH *m, const char *name) {
+	int i;
+	if(!name[0])
+		return 0;
+	for(i = 0; i < al_size(m->materials); i++) {
+		OBJ_MTL *mtl = al_get(m->materials, i);
+		if(!strcmp(name, mtl->name))
+			return i;
+	}
+	fx_error("OBJ: material '%s' not found", name);
+	return 0;
+}
+
+/* Loading happens in two passes so that the work can be split across threads:
+ *
+ * The file is split into chunks at line boundaries, and the `v`, `vt`, `vn`
+ * and `f` records in each chunk are parsed into arrays local to that chunk.
+ * Face indices are kept as they appear in the file, along with the number of
+ * vertices, normals and texture coordinates the chunk has seen up to that
+ * face, so that relative (negative) indices can be fixed up once the sizes of
+ * the preceding chunks are known.
+ *
+ * All the other commands (`g`, `usemtl`, etc.) are rare, so they are only
+ * recorded, and then executed in order between the two passes. This also
+ * gives each chunk the group, smoothing group and material it starts with.
+ *
+ * Lastly, each chunk copies its elements to their final place in the mesh.
+ */
+typedef struct {
+	int fv;           /* Index of the face's first vertex in the chunk's `fv` */
+	int n;            /* Number of vertices in the face */
+	int nv, nt, nn;   /* Vertices, texture coords and normals before the face */
+} ChunkFace;
+
+typedef struct {
+	int face;         /* The command precedes this face in the chunk */
+	int line;
+	const char *text;
+	/* State after the command was executed */
+	char *g;
+	int s, m;
+} ChunkCmd;
+
+typedef struct {
+	const char *start, *end;
+	int lines;
+
+	int error_line;
+	const char *error;
+
+	OBJ_DArray *verts, *norms, *texs;
+	OBJ_DArray *faces;  /* ChunkFace */
+	OBJ_DArray *fv;     /* Face vertex indices, as in the file */
+	OBJ_DArray *cmds;   /* ChunkCmd */
+
+	double xmin, xmax;
+	double ymin, ymax;
+	double zmin, zmax;
+
+	/* Where the chunk's elements go in the mesh, and the state
+	at the start of the chunk */
+	OBJ_MESH *m;
+	int vbase, tbase, nbase, fbase, fvbase;
+	char *g;
+	int s, mtl;
+} ObjChunk;
+
+/* Chunks smaller than this aren't worth a thread */
+#define MIN_CHUNK_SIZE	(1 << 18)
+
+#define KEYWORD(k) (wlen == sizeof(k) - 1 && !memcmp(word, k, wlen))
+
+static void *parse_chunk(void *arg) {
+	ObjChunk *c = arg;
+	const char *p, *end = c->end;
+
+	for(p = c->start; p < end; p = end_of_line(p, end) + 1) {
+		c->lines++;
+		p = skip_blanks(p, end);
+		if(p == end || *p == '\n' || *p == '#')
 			continue;
-		word = tokenize(str, " \n", &save);
-		if(!strcmp(word, "v")) {
-			double *vert = al_add(m->verts);
-			for(i = 0; i < 3; i++) {
-				/* It turns out the tokenize fails if
-				you have more than one space */
-				while(isspace(save[0])) save++;
-				vert[i] = atof(tokenize(NULL, " ", &save));
-			}
+
+		const char *word = p;
+		while(p < end && !IS_BLANK(*p) && *p != '\n') p++;
+		size_t wlen = p - word;
+		p = skip_blanks(p, end);
+
+		if(KEYWORD("v")) {
 			/* Officially, the vertices can also have a w component
 				that defaults to 1.0, but I don't support that. */
-			if(vert[0] < m->xmin) m->xmin = vert[0];
-			if(vert[0] > m->xmax) m->xmax = vert[0];
-			if(vert[1] < m->ymin) m->ymin = vert[1];
-			if(vert[1] > m->ymax) m->ymax = vert[1];
-			if(vert[2] < m->zmin) m->zmin = vert[2];
-			if(vert[2] > m->zmax) m->zmax = vert[2];
-
-		} else if(!strcmp(word, "vn")) {
-			double *norm = al_add(m->norms);
-			for(i = 0; i < 3; i++) {
-				while(isspace(save[0])) save++;
-				norm[i] = atof(tokenize(NULL, " ", &save));
-			}
-		} else if(!strcmp(word, "vt")) {
-			double *tex = al_add(m->texs);
-			for(i = 0; i < 2; i++) {
-				while(isspace(save[0])) save++;
-				tex[i] = atof(tokenize(NULL, " ", &save));
-			}
+			double *vert = al_add(c->verts);
+			if(!scan_vec(p, end, 3, vert))
+				goto bad_line;
+			if(vert[0] < c->xmin) c->xmin = vert[0];
+			if(vert[0] > c->xmax) c->xmax = vert[0];
+			if(vert[1] < c->ymin) c->ymin = vert[1];
+			if(vert[1] > c->ymax) c->ymax = vert[1];
+			if(vert[2] < c->zmin) c->zmin = vert[2];
+			if(vert[2] > c->zmax) c->zmax = vert[2];
+		} else if(KEYWORD("vn")) {
+			if(!scan_vec(p, end, 3, al_add(c->norms)))
+				goto bad_line;
+		} else if(KEYWORD("vt")) {
+			double *tex = al_add(c->texs);
+			if(!(p = scan_vec(p, end, 2, tex)))
+				goto bad_line;
 			/* w component is optional */
-			char *tex2 = tokenize(NULL, " ", &save);
-			tex[2] = tex2 ? atof(tex2) : 0.0;
-            /* Textures are flipped vertically */
-            tex[1] = 1.0 - tex[1];
-		} else if(!strcmp(word, "f")) {
-            OBJ_FACE *face = al_add(m->faces);
-            face->g = current_group;
-            face->s = smoothing_group;
-			face->m = current_mtl;
-
+			p = skip_blanks(p, end);
+			if(!scan_double(p, end, &tex[2]))
+				tex[2] = 0.0;
+			/* Textures are flipped vertically */
+			tex[1] = 1.0 - tex[1];
+		} else if(KEYWORD("f")) {
+			ChunkFace *face = al_add(c->faces);
+			face->fv = al_size(c->fv);
 			face->n = 0;
-			face->a = 3;
-			face->fv = fx_malloc(face->a * sizeof *face->fv);
-
+			face->nv = al_size(c->verts);
+			face->nt = al_size(c->texs);
+			face->nn = al_size(c->norms);
 			for(;;) {
-				while(isspace(save[0])) save++;
-				if(save[0] == '\0' || save[0] == '\n')
+				p = skip_blanks(p, end);
+				if(p == end || *p == '\n')
 					break;
-
-				int v = -1, vn = -1, vt = -1, a;
-				char *vertex = tokenize(NULL, " ", &save);
-				char *save2;
-				char *x = tokenize(vertex, "/", &save2);
-				a = atoi(x);
-				if(a < 0) /* negative indices counts from end of array */
-					v = m->verts->n + a;
-				else if (a == 0) {
-					fx_error("OBJ: vertex index is not allowed to be 0");
-                	goto error;
-				} else
-					v = a - 1;
-
-                /* It seems you don't _have_ to specify the normal index, and can still have normals */
-				if(v < m->norms->n)
-                	vn = v;
-
-				x = tokenize(NULL, "/", &save2);
-				if(x) {
-					a = x[0] ? atoi(x) : 0;
-					if(a < 0)
-						vt = m->texs->n + a;
-					else if (a == 0) {
-						fx_error("OBJ: texture index is not allowed to be 0");
-						goto error;
-					}
-					else
-						vt = a - 1;
-					x = tokenize(NULL, "/", &save2);
-					if(x) {
-						a = atoi(x);
-						if(a < 0)
-							vn = m->norms->n + a;
-						else if (a == 0) {
-							fx_error("OBJ: normal index is not allowed to be 0");
-							goto error;
-						} else
-							vn = a - 1;
-					}
+				int *idx = al_add(c->fv);
+				if(!(p = scan_face_vertex(p, end, idx)))
+					goto bad_line;
+				if(idx[0] == 0) {
+					c->error = "vertex index is not allowed to be 0";
+					goto error;
 				}
-				obj_face_add_vertex(face, v, vt, vn);
-			}
-        } else if(!strcmp(word, "g")) {
-            char group[64];
-            if(!read_line(group, sizeof group, f, &save)) {
-				goto error;
+				face->n++;
 			}
-            char **newgroupp = al_add(m->groups);
-            *newgroupp = strdup(group);
-            current_group = *newgroupp;
-        } else if(!strcmp(word, "s")) {
-            char * ss = tokenize(NULL, " ", &save);
-            if(!ss) {
-                fx_error("OBJ: unexpected end of file");
-                goto error;
-            }
-			/* `s off` will atoi() to 0 */
-            smoothing_group = atoi(ss);
-        } else if(!strcmp(word, "o")) {
-            char o[64];
-        	if(!read_line(o, sizeof o, f, &save))
-				goto error;
+		} else {
+			ChunkCmd *cmd = al_add(c->cmds);
+			cmd->face = al_size(c->faces);
+			cmd->line = c->lines;
+			cmd->text = word;
+		}
+	}
+	return NULL;
+bad_line:
+	c->error = "malformed line";
+error:
+	c->error_line = c->lines;
+	return NULL;
+}
 
-			if(m->name)
-				free(m->name);
-            m->name = strdup(o);
-		} else if(!strcmp(word, "mtllib")) {
-			/* There can be more than one material file per mtllib line,
-			which implies that you cannot have spaces in the filenames of
-			the .mtl files, yet Blender will happily export them with
-			spaces for you, hence this `#if 0` */
-# if 0
-			for(;;) {
-				while(save[0] && strchr(" \t\r", save[0])) save++;
-				if(save[0] == '\0' || save[0] == '\n')
-					break;
-				char *mtllib = tokenize(NULL, " ", &save);
-				if(!mtllib)
-					break;
-				if(!mtl_load(mtllib, m->materials)) {
-					fx_error("OBJ: unable to load mtllib %s", mtllib);
-				}
-			}
+/* Executes a command other than `v`, `vt`, `vn` or `f` at `word`.
+ * Returns 0 if the command is not supported. */
+static int obj_command(OBJ_MESH *m, const char *filename, const char *word, const char *end, ObjChunk *state) {
+	const char *p = word;
+	char *str;
+	while(p < end && !IS_BLANK(*p) && *p != '\n') p++;
+	size_t wlen = p - word;
+	p = skip_blanks(p, end);
+
+	if(KEYWORD("g")) {
+		char **newgroupp = al_add(m->groups);
+		*newgroupp = dup_rest_of_line(p, end);
+		state->g = *newgroupp;
+	} else if(KEYWORD("s")) {
+		/* `s off` leaves the smoothing group as 0 */
+		state->s = 0;
+		scan_int(p, end, &state->s);
+	} else if(KEYWORD("o")) {
+		if(m->name)
+			free(m->name);
+		m->name = dup_rest_of_line(p, end);
+	} else if(KEYWORD("mtllib")) {
+		/* There can be more than one material file per mtllib line,
+		which implies that you cannot have spaces in the filenames of
+		the .mtl files, yet Blender will happily export them with
+		spaces for you, so the whole line is taken as the filename.
+		The MTL file is relative to the OBJ file. */
+		const char *delim = strrchr(filename, '/');
+		int dirlen = delim ? delim - filename + 1 : 0;
+		char *mtllib = dup_rest_of_line(p, end);
+		str = fx_malloc(dirlen + strlen(mtllib) + 1);
+		memcpy(str, filename, dirlen);
+		strcpy(str + dirlen, mtllib);
+		if(!mtl_load(str, m->materials)) {
+			fx_error("OBJ: unable to load mtllib %s", mtllib);
+		}
+		free(str);
+		free(mtllib);
+	} else if(KEYWORD("usemtl")) {
+		str = dup_rest_of_line(p, end);
+		state->mtl = find_material(m, str);
+		free(str);
+	} else {
+		/* NOTE: I don't intend to support the more advanced geometries
+		 * listed in the specification.
+		 */
+		fx_error("OBJ: '%.*s' command is not supported", (int)wlen, word);
+		return 0;
+	}
+	return 1;
+}
+
+#undef KEYWORD
+
+static void al_resize(OBJ_DArray *al, unsigned int n) {
+	al_own(al);
+	if(n > al->a) {
+		al->a = n > 2 * al->a ? n : 2 * al->a;
+		al->els = fx_realloc(al->els, al->a * al->esize);
+	}
+	al->n = n;
+}
+
+static void *emit_chunk(void *arg) {
+	ObjChunk *c = arg;
+	OBJ_MESH *m = c->m;
+	int i, j, ci = 0;
+
+	memcpy(m->verts->els + c->vbase * m->verts->esize, c->verts->els, al_size(c->verts) * c->verts->esize);
+	memcpy(m->texs->els + c->tbase * m->texs->esize, c->texs->els, al_size(c->texs) * c->texs->esize);
+	memcpy(m->norms->els + c->nbase * m->norms->esize, c->norms->els, al_size(c->norms) * c->norms->esize);
+
+	char *g = c->g;
+	int s = c->s, mtl = c->mtl;
+	for(i = 0; i < al_size(c->faces); i++) {
+		for(; ci < al_size(c->cmds); ci++) {
+			ChunkCmd *cmd = al_get(c->cmds, ci);
+			if(cmd->face != i)
+				break;
+			g = cmd->g;
+			s = cmd->s;
+			mtl = cmd->m;
+		}
+
+		ChunkFace *cf = al_get(c->faces, i);
+		OBJ_FACE *face = (OBJ_FACE *)m->faces->els + c->fbase + i;
+		face->g = g;
+		face->s = s;
+		face->m = mtl;
+		face->n = cf->n;
+		face->a = 0;
+		face->fv = m->fv + c->fvbase + cf->fv;
+
+		for(j = 0; j < cf->n; j++) {
+			int *idx = al_get(c->fv, cf->fv + j);
+			OBJ_FACE_VERTEX *fp = &face->fv[j];
+			fp->v = resolve_index(idx[0], c->vbase + cf->nv);
+			fp->vt = -1;
+			fp->vn = -1;
+			/* It seems you don't _have_ to specify the normal index, and can still have normals */
+			if(fp->v < c->nbase + cf->nn)
+				fp->vn = fp->v;
+			if(idx[1])
+				fp->vt = resolve_index(idx[1], c->tbase + cf->nt);
+			if(idx[2])
+				fp->vn = resolve_index(idx[2], c->nbase + cf->nn);
+		}
+	}
+	return NULL;
+}
+
+/* Runs `fn` on each chunk, on its own thread */
+static void run_chunks(void *(*fn)(void *), ObjChunk *chunks, int n) {
+	int i;
+#ifdef _WIN32
+	for(i = 0; i < n; i++)
+		fn(&chunks[i]);
 #else
-			char mtllib[64];
-        	if(!read_line(mtllib, sizeof mtllib, f, &save))
-				goto error;
-			if(!mtl_load(mtllib, m->materials)) {
-				fx_error("OBJ: unable to load mtllib %s", mtllib);
-				//goto error;
-			}
+	pthread_t *threads = fx_calloc(n, sizeof *threads);
+	int *started = fx_calloc(n, sizeof *started);
+	for(i = 1; i < n; i++)
+		started[i] = !pthread_create(&threads[i], NULL, fn, &chunks[i]);
+	fn(&chunks[0]);
+	for(i = 1; i < n; i++) {
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fn(&chunks[i]);
+	}
+	free(threads);
+	free(started);
+#endif
+}
+
+OBJ_MESH *obj_load(const char *filename) {
+	return obj_load_parallel(filename, 1);
+}
+
+OBJ_MESH *obj_load_parallel(const char *filename, int nthreads) {
+	OBJ_MESH *m = NULL;
+	int i, j, nchunks, line0 = 0;
+	size_t len;
+
+	const char *text = map_file(filename, &len, 0);
+	if(!text) {
+		fx_error("OBJ: couldn't open '%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+	const char *end = text + len;
+
+	if(nthreads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-		} else if(!strcmp(word, "usemtl")) {
-			char mtlname[64];
-        	if(!read_line(mtlname, sizeof mtlname, f, &save))
+		if(nthreads <= 0)
+			nthreads = 1;
+	}
+	nchunks = len / MIN_CHUNK_SIZE + 1;
+	if(nchunks > nthreads)
+		nchunks = nthreads;
+
+	ObjChunk *chunks = fx_calloc(nchunks, sizeof *chunks);
+	const char *p = text;
+	for(i = 0; i < nchunks; i++) {
+		ObjChunk *c = &chunks[i];
+		c->start = p;
+		if(i < nchunks - 1) {
+			const char *split = text + len / nchunks * (i + 1);
+			p = end_of_line(split > p ? split : p, end);
+			if(p < end) p++;
+		} else
+			p = end;
+		c->end = p;
+
+		c->verts = al_create(3 * sizeof(numeric_t));
+		c->norms = al_create(3 * sizeof(numeric_t));
+		c->texs = al_create(3 * sizeof(numeric_t));
+		c->faces = al_create(sizeof(ChunkFace));
+		c->fv = al_create(3 * sizeof(int));
+		c->cmds = al_create(sizeof(ChunkCmd));
+		c->xmin = c->ymin = c->zmin = DBL_MAX;
+		c->xmax = c->ymax = c->zmax = -DBL_MAX;
+	}
+
+	run_chunks(parse_chunk, chunks, nchunks);
+
+	m = obj_create();
+
+	/* Execute the commands in order, and work out where each chunk's
+	elements go in the mesh */
+	ObjChunk state = {0};
+	int nverts = 0, ntexs = 0, nnorms = 0, nfaces = 0, nfv = 0;
+	for(i = 0; i < nchunks; i++) {
+		ObjChunk *c = &chunks[i];
+
+		c->m = m;
+		c->vbase = nverts;
+		c->tbase = ntexs;
+		c->nbase = nnorms;
+		c->fbase = nfaces;
+		c->fvbase = nfv;
+		c->g = state.g;
+		c->s = state.s;
+		c->mtl = state.mtl;
+
+		for(j = 0; j < al_size(c->cmds); j++) {
+			ChunkCmd *cmd = al_get(c->cmds, j);
+			if(c->error_line && cmd->line > c->error_line)
+				break;
+			if(!obj_command(m, filename, cmd->text, end, &state))
 				goto error;
-			if(mtlname[0]) {
-				int found = 0;
-				for(i = 0; i < al_size(m->materials); i++) {
-					OBJ_MTL *mtl = al_get(m->materials, i);
-					if(!strcmp(mtlname, mtl->name)) {
-						found = 1;
-						current_mtl = i;
-						break;
-					}
-				}
-				if(!found) {
-					fx_error("OBJ: material '%s' not found\n", mtlname);
-					current_mtl = 0;
-				}
-			} else {
-				current_mtl = 0;
-			}
-		} else {
-			/* NOTE: I don't intend to support the more advanced geometries
-			 * listed in the specification.
-			 */
-			fx_error("OBJ: '%s' command is not supported", word);
-            goto error;
+			cmd->g = state.g;
+			cmd->s = state.s;
+			cmd->m = state.mtl;
+		}
+		if(c->error_line) {
+			fx_error("OBJ: %s:%d: %s", filename, line0 + c->error_line, c->error);
+			goto error;
 		}
+		line0 += c->lines;
+
+		nverts += al_size(c->verts);
+		ntexs += al_size(c->texs);
+		nnorms += al_size(c->norms);
+		nfaces += al_size(c->faces);
+		nfv += al_size(c->fv);
+
+		if(c->xmin < m->xmin) m->xmin = c->xmin;
+		if(c->xmax > m->xmax) m->xmax = c->xmax;
+		if(c->ymin < m->ymin) m->ymin = c->ymin;
+		if(c->ymax > m->ymax) m->ymax = c->ymax;
+		if(c->zmin < m->zmin) m->zmin = c->zmin;
+		if(c->zmax > m->zmax) m->zmax = c->zmax;
 	}
-	fclose(f);
-	chdir(savepath);
-	return m;
+
+	al_resize(m->verts, nverts);
+	al_resize(m->texs, ntexs);
+	al_resize(m->norms, nnorms);
+	al_resize(m->faces, nfaces);
+	m->fv = fx_malloc((nfv ? nfv : 1) * sizeof *m->fv);
+
+	run_chunks(emit_chunk, chunks, nchunks);
+	set_offsets(m);
+
+	goto done;
 error:
 	obj_free(m);
-	fclose(f);
-	chdir(savepath);
-	return NULL;
+	m = NULL;
+done:
+	for(i = 0; i < nchunks; i++) {
+		ObjChunk *c = &chunks[i];
+		al_free(c->verts);
+		al_free(c->norms);
+		al_free(c->texs);
+		al_free(c->faces);
+		al_free(c->fv);
+		al_free(c->cmds);
+	}
+	free(chunks);
+	unmap_file(text, len);
+	return m;
 }
 
 int obj_save(OBJ_MESH *m, const char *objfile, const char *mtlfile) {
@@ -611,6 +1302,314 @@ int obj_save(OBJ_MESH *m, const char *objfile, const char *mtlfile) {
 	return 1;
 }
 
+/* Binary meshes
+ * -------------
+ * The file starts with an ObjBinHeader, followed by the tables it points
+ * to. Every table starts on a 16 byte boundary, so that the vertices,
+ * normals, texture coordinates and face vertices can be used in place.
+ * Strings are stored once, NUL terminated, in the string table and are
+ * referred to by their offset in it.
+ */
+#define OBJ_BIN_MAGIC   "FXOB"
+#define OBJ_BIN_VERSION 1
+#define OBJ_BIN_ORDER   0x01020304
+#define OBJ_BIN_NOSTR   0xFFFFFFFF
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t order;        /* OBJ_BIN_ORDER in the byte order of the writer */
+	uint32_t numeric_size; /* sizeof(numeric_t) */
+	uint32_t nverts, nnorms, ntexs;
+	uint32_t nfaces, nfv;
+	uint32_t nmtls, ngroups;
+	uint32_t name;
+	double bounds[6];
+	/* File offsets of the tables */
+	uint64_t verts, norms, texs, fv, faces, mtls, groups, strings;
+	uint64_t nstrings;     /* Size of the string table */
+	uint64_t size;         /* Size of the file */
+} ObjBinHeader;
+
+typedef struct {
+	int32_t n, g, s, m;   /* `g` is an index into the groups, or -1 */
+} ObjBinFace;
+
+typedef struct {
+	numeric_t Ka[3], Kd[3], Ks[3], Ke[3];
+	float Ns, Ni, d;
+	int32_t illum;
+	uint32_t name, map_Kd;
+} ObjBinMtl;
+
+#define BIN_ALIGN(x) (((x) + 15) & ~(uint64_t)15)
+
+/* Adds `s` to the string table, and returns its offset */
+static uint32_t bin_string(OBJ_DArray *strings, const char *s) {
+	if(!s)
+		return OBJ_BIN_NOSTR;
+	uint32_t offset = al_size(strings);
+	size_t len = strlen(s) + 1;
+	al_resize(strings, offset + len);
+	memcpy(al_get(strings, offset), s, len);
+	return offset;
+}
+
+static int bin_write(FILE *f, const void *data, size_t size, uint64_t offset) {
+	static const char zeros[16];
+	long pos = ftell(f);
+	if(pos < 0 || (uint64_t)pos > offset)
+		return 0;
+	if(fwrite(zeros, 1, offset - pos, f) != offset - pos)
+		return 0;
+	return !size || fwrite(data, 1, size, f) == size;
+}
+
+int obj_save_binary(OBJ_MESH *m, const char *filename) {
+	int i, g = -1;
+	ObjBinHeader h;
+	memset(&h, 0, sizeof h);
+
+	memcpy(h.magic, OBJ_BIN_MAGIC, 4);
+	h.version = OBJ_BIN_VERSION;
+	h.order = OBJ_BIN_ORDER;
+	h.numeric_size = sizeof(numeric_t);
+	h.nverts = al_size(m->verts);
+	h.nnorms = al_size(m->norms);
+	h.ntexs = al_size(m->texs);
+	h.nfaces = al_size(m->faces);
+	h.nmtls = al_size(m->materials);
+	h.ngroups = al_size(m->groups);
+	h.bounds[0] = m->xmin; h.bounds[1] = m->xmax;
+	h.bounds[2] = m->ymin; h.bounds[3] = m->ymax;
+	h.bounds[4] = m->zmin; h.bounds[5] = m->zmax;
+
+	OBJ_DArray *strings = al_create(1);
+	h.name = bin_string(strings, m->name);
+
+	/* The face vertices are written face by face, in case some faces
+	aren't in the packed array */
+	ObjBinFace *faces = fx_malloc((h.nfaces ? h.nfaces : 1) * sizeof *faces);
+	for(i = 0; i < h.nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		faces[i].n = face->n;
+		faces[i].s = face->s;
+		faces[i].m = face->m;
+		/* Faces usually refer to the same group as the face before them */
+		if(face->g && (g < 0 || *(char **)al_get(m->groups, g) != face->g)) {
+			for(g = 0; g < h.ngroups; g++)
+				if(*(char **)al_get(m->groups, g) == face->g)
+					break;
+			if(g == h.ngroups)
+				g = -1;
+		}
+		faces[i].g = face->g ? g : -1;
+		h.nfv += face->n;
+	}
+
+	ObjBinMtl *mtls = fx_calloc(h.nmtls ? h.nmtls : 1, sizeof *mtls);
+	for(i = 0; i < h.nmtls; i++) {
+		OBJ_MTL *mtl = al_get(m->materials, i);
+		memcpy(mtls[i].Ka, mtl->Ka, sizeof mtls[i].Ka);
+		memcpy(mtls[i].Kd, mtl->Kd, sizeof mtls[i].Kd);
+		memcpy(mtls[i].Ks, mtl->Ks, sizeof mtls[i].Ks);
+		memcpy(mtls[i].Ke, mtl->Ke, sizeof mtls[i].Ke);
+		mtls[i].Ns = mtl->Ns;
+		mtls[i].Ni = mtl->Ni;
+		mtls[i].d = mtl->d;
+		mtls[i].illum = mtl->illum;
+		mtls[i].name = bin_string(strings, mtl->name);
+		mtls[i].map_Kd = bin_string(strings, mtl->map_Kd);
+	}
+
+	uint32_t *groups = fx_malloc((h.ngroups ? h.ngroups : 1) * sizeof *groups);
+	for(i = 0; i < h.ngroups; i++)
+		groups[i] = bin_string(strings, *(char **)al_get(m->groups, i));
+	h.nstrings = al_size(strings);
+
+	h.verts = BIN_ALIGN(sizeof h);
+	h.norms = BIN_ALIGN(h.verts + (uint64_t)h.nverts * m->verts->esize);
+	h.texs = BIN_ALIGN(h.norms + (uint64_t)h.nnorms * m->norms->esize);
+	h.fv = BIN_ALIGN(h.texs + (uint64_t)h.ntexs * m->texs->esize);
+	h.faces = BIN_ALIGN(h.fv + (uint64_t)h.nfv * sizeof(OBJ_FACE_VERTEX));
+	h.mtls = BIN_ALIGN(h.faces + (uint64_t)h.nfaces * sizeof *faces);
+	h.groups = BIN_ALIGN(h.mtls + (uint64_t)h.nmtls * sizeof *mtls);
+	h.strings = BIN_ALIGN(h.groups + (uint64_t)h.ngroups * sizeof *groups);
+	h.size = h.strings + h.nstrings;
+
+	int ok = 0;
+	FILE *f = fopen(filename, "wb");
+	if(!f) {
+		fx_error("OBJ: Unable to create %s: %s", filename, strerror(errno));
+		goto done;
+	}
+	if(!bin_write(f, &h, sizeof h, 0)
+		|| !bin_write(f, m->verts->els, h.nverts * m->verts->esize, h.verts)
+		|| !bin_write(f, m->norms->els, h.nnorms * m->norms->esize, h.norms)
+		|| !bin_write(f, m->texs->els, h.ntexs * m->texs->esize, h.texs)
+		|| !bin_write(f, NULL, 0, h.fv))
+		goto write_error;
+	for(i = 0; i < h.nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		if(fwrite(face->fv, sizeof *face->fv, face->n, f) != (size_t)face->n)
+			goto write_error;
+	}
+	if(!bin_write(f, faces, h.nfaces * sizeof *faces, h.faces)
+		|| !bin_write(f, mtls, h.nmtls * sizeof *mtls, h.mtls)
+		|| !bin_write(f, groups, h.ngroups * sizeof *groups, h.groups)
+		|| !bin_write(f, strings->els, h.nstrings, h.strings))
+		goto write_error;
+	ok = 1;
+write_error:
+	if(fclose(f) || !ok) {
+		fx_error("OBJ: Unable to write %s: %s", filename, strerror(errno));
+		ok = 0;
+	}
+done:
+	free(faces);
+	free(mtls);
+	free(groups);
+	al_free(strings);
+	return ok;
+}
+
+/* Is the table of `n` elements of `size` bytes at `offset` in the file? */
+static int bin_table_ok(const ObjBinHeader *h, uint64_t offset, uint64_t n, size_t size) {
+	return !(offset & 15) && offset >= sizeof *h && offset <= h->size && n * size <= h->size - offset;
+}
+
+static char *bin_strdup(const ObjBinHeader *h, const char *strings, uint32_t s) {
+	if(s == OBJ_BIN_NOSTR)
+		return NULL;
+	return strdup(s < h->nstrings ? strings + s : "");
+}
+
+OBJ_MESH *obj_load_binary(const char *filename) {
+	int i;
+	size_t len;
+	char *bin = map_file(filename, &len, 1);
+	if(!bin) {
+		fx_error("OBJ: couldn't open '%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	const ObjBinHeader *h = (const ObjBinHeader *)bin;
+	if(len < sizeof *h || memcmp(h->magic, OBJ_BIN_MAGIC, 4)) {
+		fx_error("OBJ: %s: not a binary mesh", filename);
+		goto bad_file;
+	}
+	if(h->version != OBJ_BIN_VERSION || h->order != OBJ_BIN_ORDER || h->numeric_size != sizeof(numeric_t)) {
+		fx_error("OBJ: %s: binary mesh is from an incompatible version", filename);
+		goto bad_file;
+	}
+	const char *strings = bin + h->strings;
+	if(h->size != len
+		|| !bin_table_ok(h, h->verts, h->nverts, 3 * sizeof(numeric_t))
+		|| !bin_table_ok(h, h->norms, h->nnorms, 3 * sizeof(numeric_t))
+		|| !bin_table_ok(h, h->texs, h->ntexs, 3 * sizeof(numeric_t))
+		|| !bin_table_ok(h, h->fv, h->nfv, sizeof(OBJ_FACE_VERTEX))
+		|| !bin_table_ok(h, h->faces, h->nfaces, sizeof(ObjBinFace))
+		|| !bin_table_ok(h, h->mtls, h->nmtls, sizeof(ObjBinMtl))
+		|| !bin_table_ok(h, h->groups, h->ngroups, sizeof(uint32_t))
+		|| !bin_table_ok(h, h->strings, h->nstrings, 1)
+		|| h->nmtls == 0
+		|| (h->nstrings && strings[h->nstrings - 1])) {
+		fx_error("OBJ: %s: binary mesh is corrupt", filename);
+		goto bad_file;
+	}
+
+	/* Check the faces and their vertices before anything is allocated
+	for them, so that nothing downstream has to bounds-check indices */
+	const ObjBinFace *bfaces = (const ObjBinFace *)(bin + h->faces);
+	uint64_t nfv = 0;
+	for(i = 0; i < h->nfaces; i++) {
+		const ObjBinFace *bf = &bfaces[i];
+		if(bf->n < 0 || bf->m < 0 || bf->m >= h->nmtls || bf->g < -1 || bf->g >= (int64_t)h->ngroups) {
+			fx_error("OBJ: %s: binary mesh is corrupt", filename);
+			goto bad_file;
+		}
+		nfv += bf->n;
+	}
+	if(nfv != h->nfv) {
+		fx_error("OBJ: %s: binary mesh is corrupt", filename);
+		goto bad_file;
+	}
+	const OBJ_FACE_VERTEX *bfv = (const OBJ_FACE_VERTEX *)(bin + h->fv);
+	for(i = 0; i < h->nfv; i++) {
+		const OBJ_FACE_VERTEX *k = &bfv[i];
+		if(k->v < 0 || k->v >= (int64_t)h->nverts
+			|| k->vt < -1 || k->vt >= (int64_t)h->ntexs
+			|| k->vn < -1 || k->vn >= (int64_t)h->nnorms) {
+			fx_error("OBJ: %s: binary mesh is corrupt", filename);
+			goto bad_file;
+		}
+	}
+
+	OBJ_MESH *m = obj_create();
+	m->bin = bin;
+	m->bin_len = len;
+	m->name = bin_strdup(h, strings, h->name);
+	m->xmin = h->bounds[0]; m->xmax = h->bounds[1];
+	m->ymin = h->bounds[2]; m->ymax = h->bounds[3];
+	m->zmin = h->bounds[4]; m->zmax = h->bounds[5];
+
+	al_borrow(m->verts, bin + h->verts, h->nverts);
+	al_borrow(m->norms, bin + h->norms, h->nnorms);
+	al_borrow(m->texs, bin + h->texs, h->ntexs);
+	m->fv = (OBJ_FACE_VERTEX *)(bin + h->fv);
+
+	const uint32_t *groups = (const uint32_t *)(bin + h->groups);
+	al_resize(m->groups, h->ngroups);
+	for(i = 0; i < h->ngroups; i++) {
+		char *g = bin_strdup(h, strings, groups[i]);
+		*(char **)al_get(m->groups, i) = g ? g : strdup("");
+	}
+
+	/* Replaces the default material */
+	mtl_free(m->materials);
+	m->materials = mtl_create();
+	const ObjBinMtl *bmtls = (const ObjBinMtl *)(bin + h->mtls);
+	al_resize(m->materials, h->nmtls);
+	for(i = 0; i < h->nmtls; i++) {
+		const ObjBinMtl *bm = &bmtls[i];
+		OBJ_MTL *mtl = al_get(m->materials, i);
+		memcpy(mtl->Ka, bm->Ka, sizeof mtl->Ka);
+		memcpy(mtl->Kd, bm->Kd, sizeof mtl->Kd);
+		memcpy(mtl->Ks, bm->Ks, sizeof mtl->Ks);
+		memcpy(mtl->Ke, bm->Ke, sizeof mtl->Ke);
+		mtl->Ns = bm->Ns;
+		mtl->Ni = bm->Ni;
+		mtl->d = bm->d;
+		mtl->illum = bm->illum;
+		mtl->name = bin_strdup(h, strings, bm->name);
+		if(!mtl->name)
+			mtl->name = strdup("");
+		mtl->map_Kd = bin_strdup(h, strings, bm->map_Kd);
+		mtl->texture = -1;
+		mtl->texture_serial = 0;
+	}
+
+	al_resize(m->faces, h->nfaces);
+	OBJ_FACE_VERTEX *fv = m->fv;
+	for(i = 0; i < h->nfaces; i++) {
+		const ObjBinFace *bf = &bfaces[i];
+		OBJ_FACE *face = al_get(m->faces, i);
+		face->fv = fv;
+		face->n = bf->n;
+		face->a = 0;
+		face->g = bf->g < 0 ? NULL : *(char **)al_get(m->groups, bf->g);
+		face->s = bf->s;
+		face->m = bf->m;
+		fv += bf->n;
+	}
+	set_offsets(m);
+	return m;
+
+bad_file:
+	unmap_file(bin, len);
+	return NULL;
+}
+
 void obj_normalize_size(OBJ_MESH *obj) {
 	double xdim = obj->xmax - obj->xmin;
 	double ydim = obj->ymax - obj->ymin;
@@ -638,6 +1637,10 @@ void obj_normalize_size(OBJ_MESH *obj) {
 		v[2] *= ratio;
 	}
 
+	/* The vertices moved, so the lookup table is stale */
+	hash_free(obj->vhash);
+	obj->vhash = NULL;
+
 	obj->xmax *= ratio; obj->xmin *= ratio;
 	obj->ymax *= ratio; obj->ymin *= ratio;
 	obj->zmax *= ratio; obj->zmin *= ratio;
@@ -682,9 +1685,10 @@ OBJ_DArray *mtl_load(const char *filename, OBJ_DArray *materials) {
 			char newmtl[64];
         	if(!read_line(newmtl, sizeof newmtl, f, &save))
 				goto error;
+			/* Anything the material doesn't set is the default */
 			material = al_add(materials);
+			memcpy(material, &WhiteMtl, sizeof *material);
 			material->name = strdup(newmtl);
-			material->map_Kd = NULL;
 		} else if(!strcmp(word, "map_Kd")) {
 			if(!material) continue;
 			char map_Kd[64];
@@ -785,7 +1789,183 @@ int mtl_save(OBJ_DArray *materials, const char *filename) {
 	return 1;
 }
 
+/* Identifies a vertex of an OBJ_RENDER_MESH while it is being compiled */
+typedef struct {
+	int batch, v, vt, vn;
+} WeldKey;
+
+static unsigned int weld_hash(const WeldKey *k) {
+	unsigned int h = 2166136261u;
+	h = (h ^ k->batch) * 16777619u;
+	h = (h ^ k->v) * 16777619u;
+	h = (h ^ k->vt) * 16777619u;
+	h = (h ^ k->vn) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+OBJ_RENDER_MESH *obj_compile(OBJ_MESH *m) {
+	int i, j, nfv = 0, ntris = 0;
+	int nfaces = al_size(m->faces), nkeys = al_size(m->materials) * 4;
+
+	/* Faces go into batches on their material, and on whether all their
+	vertices have texture coordinates and normals, because `obj_draw()`
+	only uses them under those conditions too. */
+	int *fkey = fx_malloc((nfaces ? nfaces : 1) * sizeof *fkey);
+	int *start = fx_calloc(nkeys + 1, sizeof *start);
+	for(i = 0; i < nfaces; i++) {
+		OBJ_FACE *face = al_get(m->faces, i);
+		OBJ_FACE_VERTEX *fv = face_vertices(m, face, i);
+		int has_texs = 1, has_norms = 1;
+		for(j = 0; j < face->n; j++) {
+			if(fv[j].vt < 0) has_texs = 0;
+			if(fv[j].vn < 0) has_norms = 0;
+		}
+		fkey[i] = face->n < 3 ? -1 : face->m * 4 + has_texs * 2 + has_norms;
+		if(fkey[i] < 0)
+			continue;
+		start[fkey[i] + 1]++;
+		nfv += face->n;
+		ntris += face->n - 2;
+	}
+	for(i = 0; i < nkeys; i++)
+		start[i + 1] += start[i];
+	int nsorted = start[nkeys];
+	int *order = fx_malloc((nsorted ? nsorted : 1) * sizeof *order);
+	for(i = 0; i < nfaces; i++)
+		if(fkey[i] >= 0)
+			order[start[fkey[i]]++] = i;
+	free(start);
+
+	OBJ_RENDER_MESH *r = fx_calloc(1, sizeof *r);
+	r->verts = fx_malloc((nfv ? nfv : 1) * 3 * sizeof *r->verts);
+	r->texs = fx_malloc((nfv ? nfv : 1) * 2 * sizeof *r->texs);
+	r->norms = fx_malloc((nfv ? nfv : 1) * 3 * sizeof *r->norms);
+	r->indices = fx_malloc((ntris ? ntris : 1) * 3 * sizeof *r->indices);
+	r->batches = fx_calloc(nkeys ? nkeys : 1, sizeof *r->batches);
+
+	/* Welds identical vertices within a batch; The slots hold indices into `welded` */
+	unsigned int size = 16;
+	while(size < nfv * 2)
+		size <<= 1;
+	int *slots = fx_malloc(size * sizeof *slots);
+	memset(slots, 0xFF, size * sizeof *slots);
+	WeldKey *welded = fx_malloc((nfv ? nfv : 1) * sizeof *welded);
+
+	OBJ_BATCH *batch = NULL;
+	int *idx = r->indices, key = -1;
+	for(i = 0; i < nsorted; i++) {
+		OBJ_FACE *face = al_get(m->faces, order[i]);
+		OBJ_FACE_VERTEX *fv = face_vertices(m, face, order[i]);
+		if(fkey[order[i]] != key) {
+			key = fkey[order[i]];
+			batch = &r->batches[r->nbatches++];
+			OBJ_MTL *mtl = al_get(m->materials, face->m);
+			memcpy(batch->Ka, mtl->Ka, sizeof batch->Ka);
+			memcpy(batch->Kd, mtl->Kd, sizeof batch->Kd);
+			memcpy(batch->Ke, mtl->Ke, sizeof batch->Ke);
+			memcpy(batch->Ks, mtl->Ks, sizeof batch->Ks);
+			batch->Ns = mtl->Ns;
+			batch->d = mtl->d;
+			batch->map_Kd = mtl->map_Kd ? strdup(mtl->map_Kd) : NULL;
+			batch->texture = -1;
+			batch->texture_serial = 0;
+			batch->has_texs = (key & 2) != 0;
+			batch->has_norms = (key & 1) != 0;
+			batch->vfirst = r->nverts;
+			batch->tfirst = r->ntris;
+		}
+
+		int first = -1, prev = -1;
+		for(j = 0; j < face->n; j++) {
+			OBJ_FACE_VERTEX *fp = &fv[j];
+			WeldKey k = {r->nbatches, fp->v, batch->has_texs ? fp->vt : -1, batch->has_norms ? fp->vn : -1};
+			unsigned int s = weld_hash(&k) & (size - 1);
+			while(slots[s] >= 0 && memcmp(&welded[slots[s]], &k, sizeof k))
+				s = (s + 1) & (size - 1);
+			if(slots[s] < 0) {
+				int n = r->nverts++;
+				slots[s] = n;
+				welded[n] = k;
+				memcpy(&r->verts[3*n], obj_vert(m, k.v), 3 * sizeof *r->verts);
+				if(k.vt >= 0)
+					memcpy(&r->texs[2*n], obj_tex(m, k.vt), 2 * sizeof *r->texs);
+				else
+					r->texs[2*n] = r->texs[2*n + 1] = 0;
+				if(k.vn >= 0)
+					memcpy(&r->norms[3*n], obj_norm(m, k.vn), 3 * sizeof *r->norms);
+				else
+					r->norms[3*n] = r->norms[3*n + 1] = r->norms[3*n + 2] = 0;
+			}
+
+			/* Triangulate as a fan, in the same order `fx_end()` does */
+			int cur = slots[s] - batch->vfirst;
+			if(j == 0)
+				first = cur;
+			else if(j >= 2) {
+				idx[0] = prev;
+				idx[1] = cur;
+				idx[2] = first;
+				idx += 3;
+				r->ntris++;
+			}
+			prev = cur;
+		}
+		batch->nverts = r->nverts - batch->vfirst;
+		batch->ntris = r->ntris - batch->tfirst;
+	}
+
+	free(slots);
+	free(welded);
+	free(order);
+	free(fkey);
+	return r;
+}
+
+void obj_compiled_free(OBJ_RENDER_MESH *r) {
+	int i;
+	if(!r)
+		return;
+	free(r->verts);
+	free(r->texs);
+	free(r->norms);
+	free(r->indices);
+	for(i = 0; i < r->nbatches; i++)
+		free(r->batches[i].map_Kd);
+	free(r->batches);
+	free(r);
+}
+
 #ifndef OBJ_NODRAW
+static BmCache *TexCache = NULL;
+
+/* Counts the calls to `obj_set_texture_cache()`. Handles are only valid in
+the cache that interned them, so each one is stored with the serial of the
+cache it came from, and interned again when that isn't the current one.
+A serial rather than the cache's address, because a new cache can be
+allocated where a destroyed one was. */
+static unsigned int TexCacheSerial = 0;
+
+void obj_set_texture_cache(BmCache *cache) {
+	TexCache = cache;
+	TexCacheSerial++;
+}
+
+/* Binds the texture `map_Kd` from `TexCache`. The name is interned into
+`*handle` the first time, so after that it is found by its index. */
+static void bind_texture(const char *map_Kd, int *handle, unsigned int *serial) {
+	if(!TexCache)
+		return;
+	if(!map_Kd) {
+		fx_set_texture(NULL);
+		return;
+	}
+	if(*handle < 0 || *serial != TexCacheSerial) {
+		*handle = bc_intern(TexCache, map_Kd);
+		*serial = TexCacheSerial;
+	}
+	fx_set_texture(bc_get_handle(TexCache, *handle));
+}
+
 void obj_draw(OBJ_MESH *obj) {
 	if(!obj)
 		return;
@@ -796,17 +1976,21 @@ void obj_draw(OBJ_MESH *obj) {
 
     for(i = 0; i < obj_nfaces(obj); i++) {
 		int j;
-		OBJ_FACE *face = obj_face(obj, i);
+		OBJ_FACE *face = al_get(obj->faces, i);
+		OBJ_FACE_VERTEX *fv = face_vertices(obj, face, i);
 
 		if(face->m != mat) {
 			mat = face->m;
 			OBJ_MTL *mtl = al_get(obj->materials, mat);
 			fx_set_material(mtl->Ka, mtl->Kd, mtl->Ke);
+			fx_set_specular(mtl->Ks, mtl->Ns);
+			fx_set_alpha(mtl->d);
+			bind_texture(mtl->map_Kd, &mtl->texture, &mtl->texture_serial);
 		}
 
 		fx_begin(FX_TRIANGLE_FAN);
 		for(j = 0; j < face->n; j++) {
-			OBJ_FACE_VERTEX *fp = &face->fv[j];
+			OBJ_FACE_VERTEX *fp = &fv[j];
 			vec3_t v = obj_vert(obj, fp->v);
 			fx_vertex_v3(v);
 			int ti = fp->vt;
@@ -824,6 +2008,24 @@ void obj_draw(OBJ_MESH *obj) {
 	}
 	fx_reset_material();
 }
+
+void obj_draw_compiled(OBJ_RENDER_MESH *r) {
+	int i;
+	if(!r)
+		return;
+	for(i = 0; i < r->nbatches; i++) {
+		OBJ_BATCH *b = &r->batches[i];
+		fx_set_material(b->Ka, b->Kd, b->Ke);
+		fx_set_specular(b->Ks, b->Ns);
+		fx_set_alpha(b->d);
+		bind_texture(b->map_Kd, &b->texture, &b->texture_serial);
+		fx_draw_indexed(&r->verts[3 * b->vfirst],
+			b->has_texs ? &r->texs[2 * b->vfirst] : NULL,
+			b->has_norms ? &r->norms[3 * b->vfirst] : NULL,
+			NULL, b->nverts, &r->indices[3 * b->tfirst], b->ntris);
+	}
+	fx_reset_material();
+}
 #endif
 
 #ifdef OBJ_TEST
@@ -854,10 +2056,76 @@ int main(int argc, char *argv[]) {
 #endif
 
 #ifdef MTL_TEST
+#include "glmatrix.h"
+
+/* Draws a quad whose material has no `d` line, which has to be opaque, and
+checks that materials without `Ks` and `Ns` have no highlights */
+static int check_defaults() {
+	FILE *f = fopen("mtl-test.mtl", "w");
+	if(!f)
+		return 0;
+	fprintf(f, "newmtl quad\nKd 0.8 0.2 0.2\nKe 0.1 0.1 0.1\n");
+	fclose(f);
+	f = fopen("mtl-test.obj", "w");
+	if(!f)
+		return 0;
+	fprintf(f, "mtllib mtl-test.mtl\nv -1 -1 0\nv 1 -1 0\nv 1 1 0\nv -1 1 0\nusemtl quad\nf 1 2 3 4\n");
+	fclose(f);
+
+	OBJ_MESH *obj = obj_load("mtl-test.obj");
+	if(!obj)
+		return 0;
+	Bitmap *b = bm_create(32, 32);
+	double view[16], eye[] = {0, 0, 3}, centre[] = {0, 0, 0}, up[] = {0, 1, 0};
+	fx_set_viewport(b);
+	mat4_lookAt(eye, centre, up, view);
+	fx_set_view(view);
+	fx_clear_zbuf();
+	obj_draw(obj);
+	unsigned int c = bm_get(b, 16, 16) & 0xFFFFFF;
+	printf("centre pixel %06X\n", c);
+	fx_cleanup();
+	bm_free(b);
+	obj_free(obj);
+	remove("mtl-test.obj");
+	if(!c)
+		return 0;
+
+	/* Past the first few materials the array's memory isn't zeroed, so
+	leftovers would show up as highlights */
+	int i, ok = 1;
+	f = fopen("mtl-test.mtl", "w");
+	if(!f)
+		return 0;
+	for(i = 0; i < 12; i++)
+		fprintf(f, "newmtl m%d\nKd 0.5 0.5 0.5\n", i);
+	fclose(f);
+	OBJ_DArray *mtls = mtl_load("mtl-test.mtl", NULL);
+	remove("mtl-test.mtl");
+	if(!mtls || al_size(mtls) != 12)
+		return 0;
+	for(i = 0; i < 12; i++) {
+		OBJ_MTL *m = al_get(mtls, i);
+		if(m->Ks[0] != 0 || m->Ks[1] != 0 || m->Ks[2] != 0 || m->Ns != 0 || m->d != 1) {
+			printf("material %d: Ks %g %g %g, Ns %g, d %g\n", i, m->Ks[0], m->Ks[1], m->Ks[2], m->Ns, m->d);
+			ok = 0;
+		}
+	}
+	mtl_free(mtls);
+	return ok;
+}
+
 int main(int argc, char *argv[]) {
+	if(argc == 1) {
+		if(!check_defaults()) {
+			fprintf(stderr, "error: default material check failed\n");
+			return 1;
+		}
+		printf("default material check passed\n");
+	}
 	if(argc > 1) {
 		OBJ_DArray *mtls;
-		mtls = mtl_load(argv[1]);
+		mtls = mtl_load(argv[1], NULL);
 		if(!mtls) {
 			fprintf(stderr, "error: unable to load MTL %s", argv[1]);
 			return 1;
@@ -875,3 +2143,103 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 #endif
+
+#ifdef OBJ_BENCH
+#include <time.h>
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Writes a `n` by `n` grid of quads with texture coordinates and normals */
+static long write_grid(const char *filename, int n) {
+	int i, j;
+	FILE *f = fopen(filename, "w");
+	if(!f)
+		return -1;
+	fprintf(f, "# %dx%d grid\no grid\n", n, n);
+	for(j = 0; j < n; j++)
+		for(i = 0; i < n; i++)
+			fprintf(f, "v %f %f %f\n", (double)i / n, sin(i * 0.1) * cos(j * 0.1), (double)j / n);
+	for(j = 0; j < n; j++)
+		for(i = 0; i < n; i++)
+			fprintf(f, "vt %f %f\n", (double)i / (n - 1), (double)j / (n - 1));
+	for(j = 0; j < n; j++)
+		for(i = 0; i < n; i++)
+			fprintf(f, "vn %f %f %f\n", 0.0, 1.0, 0.0);
+	fprintf(f, "g surface\ns 1\n");
+	for(j = 0; j < n - 1; j++)
+		for(i = 0; i < n - 1; i++) {
+			int a = j * n + i + 1, b = a + 1, c = a + n + 1, d = a + n;
+			fprintf(f, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, c, c, c, d, d, d);
+		}
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+int main(int argc, char *argv[]) {
+	const char *filename = "obj-bench.obj";
+	int n = argc > 1 ? atoi(argv[1]) : 1000;
+	int nthreads = argc > 2 ? atoi(argv[2]) : 0;
+
+	long size = write_grid(filename, n);
+	if(size < 0) {
+		fprintf(stderr, "error: unable to create %s\n", filename);
+		return 1;
+	}
+
+	double t0 = now();
+	OBJ_MESH *obj = obj_load(filename);
+	double t1 = now();
+	OBJ_MESH *pobj = obj_load_parallel(filename, nthreads);
+	double t2 = now();
+	remove(filename);
+	if(!obj || !pobj) {
+		fprintf(stderr, "error: unable to load %s\n", filename);
+		return 1;
+	}
+
+	printf("%d verts, %d faces, %.1f MB\n", obj_nverts(obj), obj_nfaces(obj), size / 1e6);
+	printf("serial:   %.3fs: %.1f MB/s\n", t1 - t0, size / 1e6 / (t1 - t0));
+	printf("parallel: %.3fs: %.1f MB/s\n", t2 - t1, size / 1e6 / (t2 - t1));
+
+	const char *binfile = "obj-bench.bin";
+	if(obj_save_binary(obj, binfile)) {
+		t0 = now();
+		OBJ_MESH *bobj = obj_load_binary(binfile);
+		t1 = now();
+		if(bobj) {
+			printf("binary:   %.3fs\n", t1 - t0);
+			obj_free(bobj);
+		}
+		remove(binfile);
+	}
+	obj_free(obj);
+	obj_free(pobj);
+
+	/* Build the same grid procedurally, quad by quad, letting
+	obj_vert_at() find the vertices shared between quads */
+	int i, j, k;
+	static const int corners[][2] = {{0,0}, {1,0}, {1,1}, {0,1}};
+	t0 = now();
+	obj = obj_create();
+	for(j = 0; j < n - 1; j++)
+		for(i = 0; i < n - 1; i++) {
+			OBJ_FACE *face = obj_face(obj, obj_new_face(obj));
+			for(k = 0; k < 4; k++) {
+				int x = i + corners[k][0], z = j + corners[k][1];
+				int v = obj_vert_at(obj, (double)x / n, sin(x * 0.1) * cos(z * 0.1), (double)z / n);
+				int vt = obj_tex_at(obj, (double)x / (n - 1), (double)z / (n - 1));
+				obj_face_add_vertex(face, v, vt, obj_norm_at(obj, 0, 1, 0));
+			}
+		}
+	obj_pack(obj);
+	t1 = now();
+	printf("built %d verts, %d faces with obj_vert_at(): %.3fs\n", obj_nverts(obj), obj_nfaces(obj), t1 - t0);
+	obj_free(obj);
+	return 0;
+}
+#endif